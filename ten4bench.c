@@ -0,0 +1,815 @@
+/* ten4bench:  Measures ten4sendfile's throughput, for comparison between     *
+ * releases, file sizes, chunk sizes & sending paths.                         *
+ *                                                                            *
+ * Usage:  ten4bench [-s sizes] [-k chunks] [-p paths] [-t transports]        *
+ *                   [-r receivers] [-v volume] [-l rate] [-d dir]            *
+ *         ten4bench -b [-d dir]                                              *
+ *         ten4bench -g [-d dir]                                              *
+ *                                                                            *
+ * Each list is comma-separated, & every combination of its members is run.   *
+ *   sizes       File sizes, with an optional k, m or g suffix.  Default:     *
+ *               1k,16k,256k,4m,64m,256m.  (Add 4g for the largest files;     *
+ *               it needs that much free space in {dir}.)                     *
+ *   chunks      Values for TEN4_OPT_CHUNK; 0 lets the library choose.        *
+ *               Default:  0.                                                 *
+ *   paths       read (the plain read loop), mmap (TEN4_SF_MMAP), pipeline    *
+ *               (TEN4_SF_PIPELINE), native (the kernel's own sendfile(),     *
+ *               where there is one; the read loop otherwise) & sndbuf (the   *
+ *               read loop with TEN4_SF_SNDBUF).  Default:  all but sndbuf.   *
+ *   transports  tcp (over the loopback interface) & unix (an AF_UNIX stream  *
+ *               socket pair).  Default:  both.                               *
+ *   receivers   block (blocking reads), nonblock (nonblocking reads, with    *
+ *               poll() between them) & slow (small reads, a millisecond      *
+ *               apart).  Default:  all three.                                *
+ *   volume      How much to send per run, by repeating the file as needed    *
+ *               (but always at least once).  Slow receivers get a 64th of    *
+ *               it.  Default:  256m.                                         *
+ *   rate        A TEN4_OPT_PACE_RATE to run under, in octets per second      *
+ *               (with an optional k, m or g suffix), to see pacing hold      *
+ *               throughput down to it.  Default:  0, for none.               *
+ *   dir         Where to make the temporary files.  Default:  /tmp.          *
+ *                                                                            *
+ * Output is CSV, one line per run after a heading line:  the run's settings; *
+ * the sendfile() calls made, octets sent & seconds taken; MB/s (of 2^20      *
+ * octets); pread()/send()/writev() calls per MB, from ten4_sendfile_stats(); *
+ * process CPU time in milliseconds, which includes the receiving thread's;   *
+ * the median & 99th-percentile microseconds per sendfile() call; & how many  *
+ * calls the kernel did itself.                                               *
+ *                                                                            *
+ * With -b, it instead checks the syscall budget:  it runs a fixed set of     *
+ * transfers (a small file with headers & trailers, the same again with the   *
+ * validation cache on, large files by reading & by mapping, the same again   *
+ * with every write cut short, & a nonblocking transfer of many tiny header & *
+ * trailer pieces to a socket kept all but full, with writes cut short & made *
+ * to fail with EAGAIN besides), & compares the system calls each made        *
+ * against fixed upper bounds.  A headers-&-{len} call is also sent both by   *
+ * the kernel's sendfile() (if any) & by the emulation, to check that the two *
+ * deliver the same octets.  The calls are counted, & the writes tampered     *
+ * with, by ten4shim, which must be interposed on them (`make budget` does    *
+ * it); -b fails at once without it.  The last transfer's delivered data are  *
+ * checked octet by octet, as is its {IOVec} arrays' being left unchanged.    *
+ * One CSV line is printed per bound, & the exit status is 1 if any was       *
+ * exceeded - so a change that brings back an extra writev(), validates again *
+ * on every step, or makes some new kind of call shows up at once.            *
+ *                                                                            *
+ * With -g, it instead times small responses (1000 octets of file between     *
+ * header & trailer pieces of 24 octets each, over AF_UNIX) at piece counts   *
+ * from 1 to 256, first handing every piece to writev() & then copying them   *
+ * together per TEN4_OPT_GATHER_MIN.  One CSV line is printed per count,      *
+ * giving each way's mean microseconds per sendfile() call & the faster; the  *
+ * smallest count from which copying stays ahead is suggested on stderr, as a *
+ * setting for TEN4_OPT_GATHER_MIN on the machine at hand.                    */
+
+#define TEN4SENDFILE 1
+#include "ten4sendfile.h"
+
+#include <sys/errno.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct timeval Timeval;
+
+#define MAX_LIST 32  /* The most members a list may have.                     */
+
+/* What the receiving thread is to do.                                        */
+enum { RECV_BLOCK = 0, RECV_NONBLOCK, RECV_SLOW };
+
+typedef struct {
+  int  sd;      /* The receiving end of the connection.                       */
+  int  mode;    /* One of the RECV_* values.                                  */
+} Receiver;
+
+/* usecs_now():                                                               *
+ * Returns the time of day, in microseconds.                                  */
+static int64_t
+usecs_now(void)
+{ Timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t) now.tv_sec * 1000000 + now.tv_usec;
+} /* end of usecs_now()                                                       */
+
+/* cpu_usecs():                                                               *
+ * Returns the CPU time the process has used, in microseconds.                */
+static int64_t
+cpu_usecs(void)
+{ struct rusage use;
+  getrusage(RUSAGE_SELF, &use);
+  return (int64_t) (use.ru_utime.tv_sec + use.ru_stime.tv_sec) * 1000000
+         + use.ru_utime.tv_usec + use.ru_stime.tv_usec;
+} /* end of cpu_usecs()                                                       */
+
+/* parse_size():                                                              *
+ * Reads a size, such as "64k" or "4g", into {*size}.  Returns 0, or -1 if    *
+ * the text is malformed.                                                     */
+static int
+parse_size(const char *text, int64_t *size)
+{  char *end;
+  int64_t value = strtoll(text, &end, 10);
+  if (end == text || value < 0) return -1;
+  switch (*end)
+  { case 'k':  case 'K':  value <<= 10;  end++;  break;
+    case 'm':  case 'M':  value <<= 20;  end++;  break;
+    case 'g':  case 'G':  value <<= 30;  end++;  break;
+  }
+  if (*end != '\0') return -1;
+  *size = value;
+  return 0;
+} /* end of parse_size()                                                      */
+
+/* split():                                                                   *
+ * Breaks comma-separated {text} (which it alters) into at most MAX_LIST      *
+ * words in {words}.  Returns how many there were.                            */
+static int
+split(char *text, char *words[])
+{ int n = 0;
+  for (char *word = strtok(text, ","); word != NULL && n < MAX_LIST;
+       word = strtok(NULL, ","))
+    words[n++] = word;
+  return n;
+} /* end of split()                                                           */
+
+/* by_value():                                                                *
+ * Orders latencies for qsort().                                              */
+static int
+by_value(const void *a, const void *b)
+{ int64_t x = *(const int64_t *) a,
+          y = *(const int64_t *) b;
+  return (x < y ? -1 : x > y);
+} /* end of by_value()                                                        */
+
+/* receive():                                                                 *
+ * The receiving thread:  reads, & discards, everything until end-of-file.    */
+static void *
+receive(void *arg)
+{ Receiver *r = arg;
+      char  buf[65536];
+   ssize_t  got;
+  if (r->mode == RECV_NONBLOCK) fcntl(r->sd, F_SETFL, O_NONBLOCK);
+  for (;;)
+  { got = read(r->sd, buf, (r->mode == RECV_SLOW ? 4096 : sizeof(buf)));
+    if (got == 0) break;
+    if (got < 0)
+    { struct pollfd pfd;
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN) break;
+      pfd.fd = r->sd;  pfd.events = POLLIN;  pfd.revents = 0;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if (r->mode == RECV_SLOW) usleep(1000);
+  }
+  return NULL;
+} /* end of receive()                                                         */
+
+/* connect_pair():                                                            *
+ * Makes a connected pair of stream sockets, over loopback TCP or AF_UNIX,    *
+ * putting the sending end in {sv[0]} & the receiving one in {sv[1]}.         *
+ * Returns 0, or -1 with {errno} set.                                         */
+static int
+connect_pair(int tcp, int sv[2])
+{ struct sockaddr_in  addr;
+           socklen_t  addr_len = sizeof(addr);
+                 int  lsd,
+                      one = 1;
+  if (! tcp) return socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((lsd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+  if (bind(lsd, (struct sockaddr *) &addr, sizeof(addr))
+      || listen(lsd, 1)
+      || getsockname(lsd, (struct sockaddr *) &addr, &addr_len)
+      || (sv[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+  { close(lsd);  return -1; }
+  if (connect(sv[0], (struct sockaddr *) &addr, sizeof(addr))
+      || (sv[1] = accept(lsd, NULL, NULL)) < 0)
+  { close(sv[0]);  close(lsd);  return -1; }
+  close(lsd);
+  setsockopt(sv[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return 0;
+} /* end of connect_pair()                                                    */
+
+/* make_file():                                                               *
+ * Creates an unlinked temporary file of {size} octets in {dir}.  Returns its *
+ * descriptor, or -1.                                                         */
+static int
+make_file(const char *dir, int64_t size)
+{ static char block[1024 * 1024];
+        char  path[1024];
+         int  fd;
+  for (size_t i = 0; i < sizeof(block); i++) block[i] = (char) (i * 31 + 7);
+  snprintf(path, sizeof(path), "%s/ten4bench.XXXXXX", dir);
+  if ((fd = mkstemp(path)) < 0) return -1;
+  unlink(path);
+  for (int64_t left = size; left > 0; )
+  { size_t want = (left < (int64_t) sizeof(block) ? (size_t) left
+                   : sizeof(block));
+    ssize_t put = write(fd, block, want);
+    if (put <= 0) { close(fd);  return -1; }
+    left -= put;
+  }
+  return fd;
+} /* end of make_file()                                                       */
+
+/* run():                                                                     *
+ * Sends file {fd}, of {size} octets, repeatedly until {volume} octets have   *
+ * gone (or just once, if it is bigger), via path {path} & chunk size         *
+ * {chunk}, to a receiver of kind {mode}; then prints the line of results.    *
+ * Returns 0, or -1 if the run could not be made.                             */
+static int
+run(int fd, int64_t size, int64_t chunk, const char *path, int tcp, int mode,
+    int64_t volume)
+{ static const char *modes[] = { "block", "nonblock", "slow" };
+       Ten4_Stats  before,
+                   after;
+         Receiver  recv_arg;
+        pthread_t  thread;
+          int64_t *lat,
+                   started,
+                   cpu,
+                   sent = 0,
+                   syscalls;
+           size_t  calls = 0,
+                   max_calls;
+              int  sv[2],
+                   flags = 0,
+                   native = 0,
+                   failed = 0;
+           double  secs,
+                   mbytes;
+  if (strcmp(path, "mmap") == 0) flags = TEN4_SF_MMAP;
+  else if (strcmp(path, "pipeline") == 0) flags = TEN4_SF_PIPELINE;
+  else if (strcmp(path, "native") == 0) native = 1;
+  else if (strcmp(path, "sndbuf") == 0) flags = TEN4_SF_SNDBUF;
+  else if (strcmp(path, "read") != 0)
+  { fprintf(stderr, "unknown path \"%s\"\n", path);  return -1; }
+  ten4_sendfile_setopt(TEN4_OPT_NATIVE, native);
+  ten4_sendfile_setopt(TEN4_OPT_FLAGS, flags);
+  ten4_sendfile_setopt(TEN4_OPT_CHUNK, chunk);
+  ten4_sendfile_setopt(TEN4_OPT_TIMEOUT, -1);  /* Wait for slow readers.      */
+
+  max_calls = (size_t) (volume / (size > 0 ? size : 1)) + 1;
+  if ((lat = malloc(max_calls * sizeof(*lat))) == NULL) return -1;
+  if (connect_pair(tcp, sv)) { perror("socket");  free(lat);  return -1; }
+  recv_arg.sd = sv[1];  recv_arg.mode = mode;
+  if (pthread_create(&thread, NULL, receive, &recv_arg))
+  { close(sv[0]);  close(sv[1]);  free(lat);  return -1; }
+
+  ten4_sendfile_stats(&before);
+  cpu = cpu_usecs();
+  started = usecs_now();
+  do
+  { off_t   len  = 0;  /* I.e., the whole file.                               */
+    int64_t then = usecs_now();
+    if (sendfile(fd, sv[0], 0, &len, NULL, 0)) { failed = errno;  break; }
+    lat[calls++] = usecs_now() - then;
+    sent += len;
+  } while (sent < volume && calls < max_calls);
+  close(sv[0]);  /* So the receiver sees end-of-file.                         */
+  pthread_join(thread, NULL);
+  secs = (double) (usecs_now() - started) / 1e6;
+  cpu = cpu_usecs() - cpu;
+  ten4_sendfile_stats(&after);
+  close(sv[1]);
+  if (failed)
+  { fprintf(stderr, "sendfile():  %s\n", strerror(failed));  free(lat);
+    return -1;
+  }
+
+  qsort(lat, calls, sizeof(*lat), by_value);
+  syscalls = (int64_t) ((after.sys_read - before.sys_read)
+                        + (after.sys_send - before.sys_send)
+                        + (after.sys_writev - before.sys_writev)
+                        + (after.calls_native - before.calls_native));
+  mbytes = (double) sent / (1024 * 1024);
+  printf("%s,%s,%s,%lld,%lld,%lu,%lld,%.6f,%.2f,%.2f,%.3f,%lld,%lld,%llu\n",
+         (tcp ? "tcp" : "unix"), modes[mode], path, (long long) size,
+         (long long) chunk, (unsigned long) calls, (long long) sent, secs,
+         (secs > 0 ? mbytes / secs : 0.0),
+         (mbytes > 0 ? (double) syscalls / mbytes : 0.0),
+         (double) cpu / 1000, (long long) lat[calls / 2],
+         (long long) lat[(calls * 99) / 100],
+         (unsigned long long) (after.calls_native - before.calls_native));
+  fflush(stdout);
+  free(lat);
+  return 0;
+} /* end of run()                                                             */
+
+
+/* The syscall budget, for -b:                                                *
+ * The counts are of the real system calls made on the sending thread, as     *
+ * seen by ten4shim (see ten4shim.c), which must be loaded into the process;  *
+ * `make budget` sees to that.  Each scenario's counts are the difference     *
+ * between two snapshots taken around it.  Every call the shim covers has a   *
+ * limit in every scenario - 0, unless it is given one - so that a kind of    *
+ * call the library never used to make is caught as surely as one more of     *
+ * those it did.                                                              */
+#define BUDGET_PIECES 2500  /* Header & trailer pieces, in the last scenario. */
+
+#ifndef RTLD_DEFAULT
+#define RTLD_DEFAULT ((void *) 0)  /* As glibc has it, sans _GNU_SOURCE.      */
+#endif
+
+/* The calls budgeted, in the order of {budget_calls}, as the shim names them.*/
+enum { B_READ = 0, B_PREAD, B_LSEEK, B_WRITE, B_WRITEV, B_SEND, B_FSTAT,
+       B_FCNTL, B_GETSOCKOPT, B_SETSOCKOPT, B_MMAP, B_MUNMAP, B_MINCORE,
+       B_FADVISE, B_POLL, B_KQUEUE, B_KEVENT, B_NANOSLEEP, B_USLEEP, B_CALLS };
+
+static const char *budget_calls[B_CALLS] = {
+  "read", "pread", "lseek", "write", "writev", "send", "fstat", "fcntl",
+  "getsockopt", "setsockopt", "mmap", "munmap", "mincore", "posix_fadvise",
+  "poll", "kqueue", "kevent", "nanosleep", "usleep"
+};
+
+/* budget_shown():  Whether call {i} gets a line even when it is neither made *
+ * nor allowed:  seeking & sleeping, which none of the scenarios (being all   *
+ * unpaced) should ever do - not the old lseek() & read(), nor a nap.         */
+#define budget_shown(i)                                                       \
+  ((i) == B_LSEEK || (i) == B_NANOSLEEP || (i) == B_USLEEP)
+
+/* The shim's controls, found at run time, or NULL if it is not loaded.       */
+typedef void     (*Shim_Watch)(int);
+typedef void     (*Shim_Tamper)(size_t, int);
+typedef uint64_t (*Shim_Count)(const char *);
+
+static Shim_Watch  shim_watch  = NULL;
+static Shim_Tamper shim_tamper = NULL;
+static Shim_Count  shim_count  = NULL;
+
+/* What is known of the scenario under way.                                   */
+typedef struct {
+  const char *name;
+    uint64_t  before[B_CALLS],  /* The shim's counts, before it.              */
+              limit[B_CALLS];   /* The most of each call it may make.         */
+  Ten4_Stats  stats;            /* The library's own counts, before it.       */
+} Budget;
+
+/* LIMIT():  Allows scenario {b} up to {n} calls of {call}.                   */
+#define LIMIT(b, call, n)  ((b).limit[B_##call] = (uint64_t) (n))
+
+/* RETRIES():  How many of library counter {f} scenario {b} has run up.       */
+#define RETRIES(b, f)  (after.f - (b).stats.f)
+
+/* over_budget():                                                             *
+ * Prints the line for one bound of scenario {name}, & says whether the count *
+ * {counter}, of {used}, exceeded {limit}.                                    */
+static int
+over_budget(const char *name, const char *counter, uint64_t used,
+            uint64_t limit)
+{ printf("%s,%s,%llu,%llu,%s\n", name, counter, (unsigned long long) used,
+         (unsigned long long) limit, (used <= limit ? "ok" : "OVER"));
+  return (used > limit);
+} /* end of over_budget()                                                     */
+
+/* budget_start():                                                            *
+ * Begins scenario {name}, with no calls allowed yet, in {*b}.                */
+static void
+budget_start(Budget *b, const char *name)
+{ b->name = name;
+  for (int i = 0; i < B_CALLS; i++)
+  { b->before[i] = shim_count(budget_calls[i]);  b->limit[i] = 0; }
+  ten4_sendfile_stats(&b->stats);
+} /* end of budget_start()                                                    */
+
+/* budget_end():                                                              *
+ * Prints a line for each call that scenario {*b} made or was allowed, & says *
+ * whether any went over its limit.                                           */
+static int
+budget_end(const Budget *b)
+{ int over = 0;
+  for (int i = 0; i < B_CALLS; i++)
+  { uint64_t used = shim_count(budget_calls[i]) - b->before[i];
+    if (used > 0 || b->limit[i] > 0 || budget_shown(i))
+      over |= over_budget(b->name, budget_calls[i], used, b->limit[i]);
+  }
+  return over;
+} /* end of budget_end()                                                      */
+
+/* Collector:  For the last scenario, the receiving thread saves what comes.  */
+typedef struct {
+     int  sd;    /* The receiving end of the connection.                      */
+    char *buf;   /* Where to put what arrives.                                */
+  size_t  size,  /* Its capacity.                                             */
+          got;   /* How much has arrived.                                     */
+} Collector;
+
+/* collect():                                                                 *
+ * The collecting thread:  reads in small pieces, slowly, so that the sender  *
+ * keeps finding the socket full, until end-of-file.                          */
+static void *
+collect(void *arg)
+{ Collector *c = arg;
+    ssize_t  got;
+  while (c->got < c->size
+         && (got = read(c->sd, c->buf + c->got,
+                        (c->size - c->got < 700 ? c->size - c->got : 700))) > 0)
+  { c->got += got;
+    usleep(50);
+  }
+  return NULL;
+} /* end of collect()                                                         */
+
+/* capture():                                                                 *
+ * Sends {len} octets of {fd} from {offset}, with {*hdtr}, in one sendfile()  *
+ * call to an AF_UNIX socket, collecting what arrives into {*c} (whose {buf}  *
+ * & {size} must be set).  Returns sendfile()'s result, or -1.                */
+static int
+capture(int fd, off_t offset, off_t len, Sf_HdTr *hdtr, Collector *c)
+{ pthread_t  thread;
+        int  sv[2],
+             result;
+  if (connect_pair(0, sv)) return -1;
+  c->sd = sv[1];  c->got = 0;
+  if (pthread_create(&thread, NULL, collect, c))
+  { close(sv[0]);  close(sv[1]);  return -1; }
+  result = sendfile(fd, sv[0], offset, &len, hdtr, 0);
+  close(sv[0]);
+  pthread_join(thread, NULL);
+  close(sv[1]);
+  return result;
+} /* end of capture()                                                         */
+
+/* budget_send():                                                             *
+ * Sends {fd} (all of it) plus any {hdtr} to a blocking AF_UNIX socket whose  *
+ * other end is drained by a receiving thread, {calls} times, with the shim   *
+ * (if loaded) watching only the sendfile() calls.  Returns 0, or -1.         */
+static int
+budget_send(int fd, Sf_HdTr *hdtr, int calls)
+{  Receiver  recv_arg;
+  pthread_t  thread;
+        int  sv[2],
+             result = 0;
+  if (connect_pair(0, sv)) return -1;
+  recv_arg.sd = sv[1];  recv_arg.mode = RECV_BLOCK;
+  if (pthread_create(&thread, NULL, receive, &recv_arg))
+  { close(sv[0]);  close(sv[1]);  return -1; }
+  if (shim_watch != NULL) shim_watch(1);
+  for (int i = 0; i < calls && result == 0; i++)
+  { off_t len = 0;
+    result = sendfile(fd, sv[0], 0, &len, hdtr, 0);
+  }
+  if (shim_watch != NULL) shim_watch(0);
+  close(sv[0]);
+  pthread_join(thread, NULL);
+  close(sv[1]);
+  return result;
+} /* end of budget_send()                                                     */
+
+/* check_budget():                                                            *
+ * Runs the scenarios of -b, with temporary files in {dir}.  Returns the exit *
+ * status:  0 if all were within budget, 1 if any was not, or 2 if a          *
+ * scenario could not be run at all.                                          */
+static int
+check_budget(const char *dir)
+{ static char  pieces[BUDGET_PIECES * 2][4];
+  static IOVec hdrs[BUDGET_PIECES],
+               trls[BUDGET_PIECES],
+               copy[2][BUDGET_PIECES];
+      Budget   b;
+  Ten4_Stats   after;
+     Sf_HdTr   hdtr;
+       IOVec   hdr = { "HTTP/1.1 200 OK\r\n\r\n", 19 },
+               trl = { "\r\n0\r\n\r\n", 7 };
+         int   small,
+               large,
+               failed = 0;
+  shim_watch  = (Shim_Watch) dlsym(RTLD_DEFAULT, "ten4shim_watch");
+  shim_tamper = (Shim_Tamper) dlsym(RTLD_DEFAULT, "ten4shim_tamper");
+  shim_count  = (Shim_Count) dlsym(RTLD_DEFAULT, "ten4shim_count");
+  if (shim_watch == NULL || shim_tamper == NULL || shim_count == NULL)
+  { fprintf(stderr, "-b needs ten4shim loaded, to count system calls "
+                    "(see `make budget`)\n");
+    return 2;
+  }
+  small = make_file(dir, 1000);
+  large = make_file(dir, 8 * 1024 * 1024);
+  if (small < 0 || large < 0) { perror("temporary file");  return 2; }
+  ten4_sendfile_setopt(TEN4_OPT_NATIVE, 0);  /* Count our own syscalls.       */
+  ten4_sendfile_setopt(TEN4_OPT_FLAGS, 0);
+  ten4_sendfile_setopt(TEN4_OPT_CHUNK, 256 * 1024);
+  ten4_sendfile_setopt(TEN4_OPT_TIMEOUT, -1);
+  ten4_sendfile_setopt(TEN4_OPT_VCACHE, 0);
+  printf("scenario,counter,used,limit,verdict\n");
+
+  /* A small response goes out in a single writev(), after validation that    *
+   * costs an fstat() of each descriptor & little else.                       */
+  hdtr.headers  = &hdr;  hdtr.hdr_cnt  = 1;
+  hdtr.trailers = &trl;  hdtr.trlr_cnt = 1;
+  budget_start(&b, "small");
+  if (budget_send(small, &hdtr, 1)) { perror("small");  return 2; }
+  LIMIT(b, WRITEV, 1);      LIMIT(b, PREAD, 1);  LIMIT(b, FSTAT, 2);
+  LIMIT(b, GETSOCKOPT, 1);  LIMIT(b, FCNTL, 1);
+  failed |= budget_end(&b);
+
+  /* Once the validation cache knows both descriptors, repeats of it need no  *
+   * validation at all, save the fcntl() that finds out whether the socket is *
+   * (still) nonblocking.                                                     */
+  ten4_sendfile_setopt(TEN4_OPT_VCACHE, 1);
+  budget_start(&b, "vcache");
+  if (budget_send(small, &hdtr, 10)) { perror("vcache");  return 2; }
+  ten4_sendfile_setopt(TEN4_OPT_VCACHE, 0);  /* Also forgets everything.      */
+  LIMIT(b, WRITEV, 10);     LIMIT(b, PREAD, 10);  LIMIT(b, FSTAT, 2);
+  LIMIT(b, GETSOCKOPT, 1);  LIMIT(b, FCNTL, 10);
+  failed |= budget_end(&b);
+
+  /* A large file takes one pread() & one send() per chunk, & the headers &   *
+   * trailers a writev() each.  Trying to cork the socket costs a             *
+   * getsockopt(), which (this not being TCP) fails.                          */
+  budget_start(&b, "large");
+  if (budget_send(large, &hdtr, 1)) { perror("large");  return 2; }
+  LIMIT(b, PREAD, 32 + 1);  LIMIT(b, SEND, 32);        LIMIT(b, WRITEV, 2);
+  LIMIT(b, FSTAT, 2);       LIMIT(b, GETSOCKOPT, 2);   LIMIT(b, FCNTL, 1);
+  failed |= budget_end(&b);
+
+  /* Mapped, it needs no reads, & a send() & a mapping per window.            */
+  ten4_sendfile_setopt(TEN4_OPT_FLAGS, TEN4_SF_MMAP);
+  budget_start(&b, "mmap");
+  if (budget_send(large, NULL, 1)) { perror("mmap");  return 2; }
+  ten4_sendfile_setopt(TEN4_OPT_FLAGS, 0);
+  LIMIT(b, SEND, 2);   LIMIT(b, MMAP, 2);        LIMIT(b, MUNMAP, 2);
+  LIMIT(b, FSTAT, 2);  LIMIT(b, GETSOCKOPT, 2);  LIMIT(b, FCNTL, 1);
+  failed |= budget_end(&b);
+
+  /* The kernel's sendfile(), where there is one, must send just what the     *
+   * emulation does for the same call:  its headers, {len} octets of file, &  *
+   * its trailers - though the kernel counts headers in {len}, & we do not.   */
+  { Collector  col[2];
+          int  result[2],
+               good;
+    for (int native = 0; native < 2; native++)
+    { ten4_sendfile_setopt(TEN4_OPT_NATIVE, native);
+      col[native].size = 4096;
+      if ((col[native].buf = malloc(col[native].size)) == NULL)
+      { perror("native");  return 2; }
+      result[native] = capture(small, 100, 500, &hdtr, &col[native]);
+    }
+    ten4_sendfile_setopt(TEN4_OPT_NATIVE, 0);
+    good = (result[0] == 0 && result[1] == 0
+            && col[0].got == hdr.iov_len + 500 + trl.iov_len
+            && col[1].got == col[0].got
+            && memcmp(col[0].buf, col[1].buf, col[0].got) == 0);
+    failed |= over_budget("native", "wrong_octets", ! good, 0);
+    free(col[0].buf);  free(col[1].buf);
+  }
+
+  /* Every write cut short, on a blocking socket:  each short one costs one   *
+   * more, without any waiting or reading again.                              */
+  shim_tamper(50000, 0);
+  budget_start(&b, "choppy");
+  if (budget_send(large, &hdtr, 1)) { perror("choppy");  return 2; }
+  shim_tamper(0, 0);
+  ten4_sendfile_stats(&after);
+  LIMIT(b, PREAD, 32 + 1);  LIMIT(b, SEND, 32 + RETRIES(b, partial));
+  LIMIT(b, WRITEV, 2);      LIMIT(b, FSTAT, 2);
+  LIMIT(b, GETSOCKOPT, 2);  LIMIT(b, FCNTL, 1);
+  failed |= budget_end(&b);
+
+  /* Many tiny pieces, to a socket kept nearly full, with writes cut short &  *
+   * made to fail with EAGAIN besides:  every short write or EAGAIN may cost  *
+   * a retry, but nothing else may; the file (all one chunk) is read once, &  *
+   * the transfer as a whole validated once, however many steps it takes.     */
+  { Collector  col;
+    pthread_t  thread;
+     Ten4_Ctx  ctx;
+        off_t  total = 0;
+       size_t  expect = BUDGET_PIECES * 2 * 3 + 256 * 1024;
+          int  sv[2],
+               sndbuf = 4096,
+               result;
+        char  *data;
+    for (int i = 0; i < BUDGET_PIECES * 2; i++)
+      snprintf(pieces[i], sizeof(pieces[i]), "%03d", i % 1000);
+    for (int i = 0; i < BUDGET_PIECES; i++)
+    { hdrs[i].iov_base = pieces[i];  hdrs[i].iov_len = 3;
+      trls[i].iov_base = pieces[BUDGET_PIECES + i];  trls[i].iov_len = 3;
+    }
+    memcpy(copy[0], hdrs, sizeof(hdrs));  memcpy(copy[1], trls, sizeof(trls));
+    hdtr.headers  = hdrs;  hdtr.hdr_cnt  = BUDGET_PIECES;
+    hdtr.trailers = trls;  hdtr.trlr_cnt = BUDGET_PIECES;
+    if (connect_pair(0, sv)) { perror("socket");  return 2; }
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    col.sd = sv[1];  col.size = expect + 1;  col.got = 0;
+    if ((col.buf = malloc(col.size)) == NULL
+        || (data = malloc(256 * 1024)) == NULL
+        || pread(large, data, 256 * 1024, 0) != 256 * 1024
+        || pthread_create(&thread, NULL, collect, &col))
+    { perror("short");  return 2; }
+    shim_tamper(700, 5);
+    budget_start(&b, "short");
+    shim_watch(1);
+    result = ten4_sendfile_init(&ctx, large, sv[0], 0, 256 * 1024, &hdtr, 0);
+    shim_watch(0);
+    if (result) { perror("short");  return 2; }
+    for (;;)
+    { struct pollfd pfd;
+      shim_watch(1);
+      result = ten4_sendfile_step(&ctx);
+      shim_watch(0);
+      if (result == 0 || errno != EAGAIN) break;
+      pfd.fd = sv[0];  pfd.events = POLLOUT;  pfd.revents = 0;
+      poll(&pfd, 1, -1);  /* Ours, & so not counted.                          */
+    }
+    shim_watch(1);
+    ten4_sendfile_finish(&ctx, &total);
+    shim_watch(0);
+    shim_tamper(0, 0);
+    ten4_sendfile_stats(&after);
+    close(sv[0]);
+    pthread_join(thread, NULL);
+    close(sv[1]);
+    LIMIT(b, FSTAT, 2);  LIMIT(b, GETSOCKOPT, 2);  LIMIT(b, FCNTL, 1);
+    LIMIT(b, WRITEV, RETRIES(b, eagain) + 2 * RETRIES(b, partial) + 4);
+    LIMIT(b, SEND, RETRIES(b, eagain) + RETRIES(b, partial) + 1);
+    LIMIT(b, PREAD, 1);
+    failed |= budget_end(&b);
+    /* ... & delivers exactly what it should, without disturbing the arrays.  */
+    { int good = (result == 0 && (size_t) total == expect && col.got == expect
+                  && memcmp(hdrs, copy[0], sizeof(hdrs)) == 0
+                  && memcmp(trls, copy[1], sizeof(trls)) == 0
+                  && memcmp(col.buf + BUDGET_PIECES * 3, data, 256 * 1024)
+                     == 0);
+      for (int i = 0; good && i < BUDGET_PIECES; i++)
+        good = (memcmp(col.buf + i * 3, pieces[i], 3) == 0
+                && memcmp(col.buf + expect - (BUDGET_PIECES - i) * 3,
+                          pieces[BUDGET_PIECES + i], 3) == 0);
+      failed |= over_budget("short", "wrong_octets", ! good, 0);
+    }
+    free(col.buf);  free(data);
+  }
+  close(small);  close(large);
+  return failed;
+} /* end of check_budget()                                                    */
+
+
+/* The gathering comparison, for -g:                                          */
+#define GATHER_PIECES 256   /* The most header & trailer pieces tried.        */
+#define GATHER_CALLS  2000  /* sendfile() calls timed per count & way.        */
+
+static char  gather_text[GATHER_PIECES][24];
+static IOVec gather_hdrs[GATHER_PIECES / 2],
+             gather_trls[GATHER_PIECES / 2];
+
+/* time_gather():                                                             *
+ * Sends {fd} with {n} pieces, split between headers & trailers, GATHER_CALLS *
+ * times over, with TEN4_OPT_GATHER_MIN at {gather_min}.  Returns the mean    *
+ * microseconds per call, or -1 if sending failed.                            */
+static double
+time_gather(int fd, int n, int64_t gather_min)
+{ Sf_HdTr hdtr;
+  int64_t started;
+      int result;
+  hdtr.headers  = gather_hdrs;  hdtr.hdr_cnt  = (n + 1) / 2;
+  hdtr.trailers = (n > 1 ? gather_trls : NULL);  hdtr.trlr_cnt = n / 2;
+  ten4_sendfile_setopt(TEN4_OPT_GATHER_MIN, gather_min);
+  budget_send(fd, &hdtr, 10);  /* Warm the caches & the buffer pool.          */
+  started = usecs_now();
+  result = budget_send(fd, &hdtr, GATHER_CALLS);
+  return (result ? -1 : (double) (usecs_now() - started) / GATHER_CALLS);
+} /* end of time_gather()                                                     */
+
+/* compare_gather():                                                          *
+ * Runs the comparison of -g, with a temporary file in {dir}.  Returns the    *
+ * exit status:  0, or 2 if it could not be run.                              */
+static int
+compare_gather(const char *dir)
+{ int fd = make_file(dir, 1000),
+      suggest = 0;
+  if (fd < 0) { perror("temporary file");  return 2; }
+  for (int i = 0; i < GATHER_PIECES; i++)
+  { IOVec *piece = (i % 2 ? &gather_trls[i / 2] : &gather_hdrs[i / 2]);
+    memset(gather_text[i], 'a' + i % 26, sizeof(gather_text[i]));
+    piece->iov_base = gather_text[i];
+    piece->iov_len  = sizeof(gather_text[i]);
+  }
+  ten4_sendfile_setopt(TEN4_OPT_NATIVE, 0);
+  ten4_sendfile_setopt(TEN4_OPT_FLAGS, 0);
+  ten4_sendfile_setopt(TEN4_OPT_CHUNK, 0);
+  ten4_sendfile_setopt(TEN4_OPT_TIMEOUT, -1);
+  printf("pieces,piece_octets,writev_usecs,gather_usecs,faster\n");
+  for (int n = 1; n <= GATHER_PIECES; n *= 2)
+  { double apart    = time_gather(fd, n, 0),
+           together = time_gather(fd, n, 1);
+    if (apart < 0 || together < 0) { perror("sendfile");  return 2; }
+    printf("%d,%lu,%.3f,%.3f,%s\n", n, (unsigned long) sizeof(gather_text[0]),
+           apart, together, (together < apart ? "gather" : "writev"));
+    fflush(stdout);
+    if (together >= apart) suggest = 0;
+    else if (suggest == 0) suggest = n;
+  }
+  ten4_sendfile_setopt(TEN4_OPT_GATHER_MIN, 0);
+  if (suggest > 0)
+    fprintf(stderr, "suggested TEN4_OPT_GATHER_MIN:  %d\n", suggest);
+  else
+    fprintf(stderr, "suggested TEN4_OPT_GATHER_MIN:  0 (writev() won)\n");
+  close(fd);
+  return 0;
+} /* end of compare_gather()                                                  */
+
+
+/* usage():                                                                   *
+ * Explains the command line, for program {name}.  Returns the exit status.   */
+static int
+usage(const char *name)
+{ fprintf(stderr, "usage:  %s [-s sizes] [-k chunks] [-p paths]"
+          " [-t transports]\n        [-r receivers] [-v volume] [-l rate]"
+          " [-d dir]\n"
+          "        %s -b [-d dir]\n        %s -g [-d dir]\n", name, name,
+          name);
+  return 2;
+} /* end of usage()                                                           */
+
+
+int
+main(int argc, char *argv[])
+{   char  sizes_def[]  = "1k,16k,256k,4m,64m,256m",
+          chunks_def[] = "0",
+          paths_def[]  = "read,mmap,pipeline,native",
+          trans_def[]  = "tcp,unix",
+          recvs_def[]  = "block,nonblock,slow",
+         *size_txt  = sizes_def,
+         *chunk_txt = chunks_def,
+         *path_txt  = paths_def,
+         *trans_txt = trans_def,
+         *recv_txt  = recvs_def,
+         *dir       = "/tmp",
+         *sizes[MAX_LIST],
+         *chunks[MAX_LIST],
+         *paths[MAX_LIST],
+         *trans[MAX_LIST],
+         *recvs[MAX_LIST];
+  int64_t volume = 256 * 1024 * 1024,
+          rate   = 0,
+          size,
+          chunk;
+      int n_size, n_chunk, n_path, n_trans, n_recv,
+          opt,
+          status = 0;
+      int budget = 0,
+          gather = 0;
+  while ((opt = getopt(argc, argv, "bgs:k:p:t:r:v:l:d:")) != -1)
+    switch (opt)
+    { case 'b':  budget    = 1;       break;
+      case 'g':  gather    = 1;       break;
+      case 's':  size_txt  = optarg;  break;
+      case 'k':  chunk_txt = optarg;  break;
+      case 'p':  path_txt  = optarg;  break;
+      case 't':  trans_txt = optarg;  break;
+      case 'r':  recv_txt  = optarg;  break;
+      case 'd':  dir       = optarg;  break;
+      case 'v':
+        if (parse_size(optarg, &volume) == 0) break;
+        return usage(argv[0]);
+      case 'l':
+        if (parse_size(optarg, &rate) == 0) break;
+        return usage(argv[0]);
+      default:
+        return usage(argv[0]);
+    }
+  if (budget) return check_budget(dir);
+  if (gather) return compare_gather(dir);
+  ten4_sendfile_setopt(TEN4_OPT_PACE_RATE, rate);
+  n_size  = split(size_txt, sizes);
+  n_chunk = split(chunk_txt, chunks);
+  n_path  = split(path_txt, paths);
+  n_trans = split(trans_txt, trans);
+  n_recv  = split(recv_txt, recvs);
+
+  printf("transport,receiver,path,size,chunk,calls,octets,secs,mb_per_sec,"
+         "syscalls_per_mb,cpu_ms,p50_usecs,p99_usecs,native_calls\n");
+  for (int i = 0; i < n_size; i++)
+  { int fd;
+    if (parse_size(sizes[i], &size))
+    { fprintf(stderr, "bad size \"%s\"\n", sizes[i]);  return 2; }
+    if ((fd = make_file(dir, size)) < 0)
+    { perror("temporary file");  return 1; }
+    for (int c = 0; c < n_chunk; c++)
+    { if (parse_size(chunks[c], &chunk))
+      { fprintf(stderr, "bad chunk size \"%s\"\n", chunks[c]);  return 2; }
+      for (int t = 0; t < n_trans; t++)
+        for (int r = 0; r < n_recv; r++)
+          for (int p = 0; p < n_path; p++)
+          { int tcp  = (strcmp(trans[t], "tcp") == 0),
+                mode = (strcmp(recvs[r], "nonblock") == 0 ? RECV_NONBLOCK
+                        : strcmp(recvs[r], "slow") == 0 ? RECV_SLOW
+                        : RECV_BLOCK);
+            if (run(fd, size, chunk, paths[p], tcp, mode,
+                    (mode == RECV_SLOW ? volume / 64 : volume)))
+              status = 1;
+          }
+    }
+    close(fd);
+  }
+  return status;
+} /* end of main()                                                            */
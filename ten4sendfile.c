@@ -1,8 +1,29 @@
 /* ten4sendfile:  Implements sendfile(2), as missing from Mac OS 10.4.        *
  *                                                                            *
  * Sendfile() appears in the Mac OS 10.4 system headers, but was not actually *
- * implemented.  (No manpage for it was provided, either).  This tiny library *
- * rectifies the former oversight.                                            */
+ * implemented.  (No manpage for it was provided, either).  This library      *
+ * rectifies the former oversight, & builds on it the rest of what            *
+ * ten4sendfile.h declares.  From the top of this file down, it has:          *
+ *                                                                            *
+ *  - Settings & per-thread state:  load_config() reads TEN4SENDFILE_* from   *
+ *    the environment, & each thread keeps its own statistics (see STAT())    *
+ *    & pool of buffers.                                                      *
+ *  - The trace file, waiting on the socket (wait_writable()), pacing, & the  *
+ *    options (ten4_sendfile_setopt()).                                       *
+ *  - Moving the data:  spooling {IOVec} arrays & buffers to the socket, the  *
+ *    mapped window, sizing of chunks & socket buffers, read-ahead advice,    *
+ *    TEN4_SF_NODISKIO's residency checks, & corking.                         *
+ *  - The validation cache & the content cache.                               *
+ *  - The gathering copy, & coalesced replies (send_coalesced()).             *
+ *  - The read-ahead pipeline.                                                *
+ *  - Resumable transfers:  validating & recording the arguments (setup()),   *
+ *    then ten4_sendfile_init(), _step() & _finish(), & the setting of their  *
+ *    digests & pacing.  Everything after these is built on them.             *
+ *  - CRC-32, & the prefetcher.                                               *
+ *  - The asynchronous engine, & the worker pool built on it.                 *
+ *  - The statistics, then sendfile() itself, which hands what it can to the  *
+ *    kernel's own where there is one.                                        *
+ *  - sendfilev(), & multipart byte ranges.                                   */
 
 /* Derived from the Leopard manpage:                                          *
  *                                                                            *
@@ -23,7 +44,8 @@
  *     header and/or trailer data meant to bookend the file data.  The Mac OS *
  *     documentation does not explain as much, but real-world examples reveal *
  *     that {hdtr} data should count towards the number of octets transmitted.*
- * {flags} is a reserved {int}.                                               *
+ * {flags} is a reserved {int}.  (This library gives meaning to the TEN4_SF_* *
+ *     bits defined in its header; any others are still reserved.)            *
  *                                                                            *
  * sendfile() returns 0 on success, or -1 (with {errno} set appropriately) on *
  * failure.                                                                   *
@@ -31,14 +53,20 @@
  * Upon failure, {errno} may equal any of the following values, for the given *
  * reasons:                                                                   *
  * EAGAIN   {s} is marked for nonblocking I/O, and sendfile() was pre-empted. *
- *          {len} returns the number of octets actually sent.                 *
+ *          {len} returns the number of octets actually sent.  (This library  *
+ *          also returns it when a blocking {s} stays full for longer than    *
+ *          the TEN4_OPT_TIMEOUT setting allows.)                             *
  * EBADF    {fd} is not a valid file descriptor, or {s} is not a valid socket *
  *          descriptor.                                                       *
+ * EBUSY    (For TEN4_SF_NODISKIO only.)  Part of the file that was to be     *
+ *          sent next was not in memory.  {len} returns the number of octets  *
+ *          actually sent.                                                    *
  * EFAULT   {len} is non-valid, or {hdtr} (or something it points to) is non- *
  *          valid.                                                            *
  * EINTR    sendfile() was interupted by signal.  {len} returns the number of *
  *          octets actually sent (potentially zero).                          *
- * EINVAL   {offset} is negative, or {len} is NULL, or {flags} is nonzero.    *
+ * EINVAL   {offset} is negative, or {len} is NULL, or {flags} is nonzero     *
+ *          (other than in the TEN4_SF_* bits).                               *
  * EIO      An error occurred while reading from {fd}.                        *
  * ENOTCONN {s} is not connected.                                             *
  * ENOTSOCK {s} does not represent a stream-oriented socket -- or it does not *
@@ -48,18 +76,698 @@
  * EPIPE    The connection to {s} was closed from the other end.              */
 
 #include <sys/errno.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+/* Every Mac OS release we care about (10.3 onward) has kqueue(2); poll(2) is *
+ * the fallback, both for other systems and for when kqueue() itself fails.   */
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define TEN4_HAVE_KQUEUE 1
+#endif
+
+/* Mac OS 10.5 (Darwin 9) onward has a real sendfile(2) in libSystem, which   *
+ * we look up at runtime so that one build can serve every release.           */
+#ifdef __APPLE__
+#include <sys/utsname.h>
+#include <dlfcn.h>
+#define TEN4_LIBSYSTEM "/usr/lib/libSystem.B.dylib"
+#endif
+
+/* Holding back partial segments while a transfer is under way is spelt       *
+ * TCP_NOPUSH on the BSDs (Mac OS included) & TCP_CORK on Linux.              */
+#if defined(TCP_NOPUSH)
+#define TEN4_NOPUSH TCP_NOPUSH
+#elif defined(TCP_CORK)
+#define TEN4_NOPUSH TCP_CORK
+#endif
+
+/* The vector units that the gathering copy (see gather_iovv()) can use.  A   *
+ * G3 has no AltiVec, so the kernel's say-so is sought at runtime; every      *
+ * Intel Mac has SSE2.                                                        */
+#if defined(__ALTIVEC__)
+#ifndef __APPLE_ALTIVEC__
+#include <altivec.h>
+#endif
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define TEN4SENDFILE 1
 #include "ten4sendfile.h"
 
 typedef struct stat     Stat;
 typedef struct timespec Timespec;
+typedef struct timeval  Timeval;
+
+static const uint32_t MAX_RETRIES = 50;  /* For transient failures of read(). */
+
+/* The most header & trailer {IOVec}s that can be coalesced with file data,   *
+ * which is limited by the array having to go on the stack.                   */
+#define COALESCE_IOVS 64
+
+/* How much of a file to map at once, for TEN4_SF_MMAP.  In a 32-bit address  *
+ * space, much more than this could fail to find room.                        */
+static const size_t MMAP_WINDOW = (sizeof(void *) > 4 ? 64 : 4) * 1024 * 1024;
+
+/* Settings changeable via ten4_sendfile_setopt():                            */
+static int64_t opt_timeout_ms = 833;  /* Roughly what 50 retries, 1/60 second *
+                                       * apart, used to amount to.            */
+static int64_t opt_coalesce   = 16384;  /* Most small HTTP responses.         */
+static int64_t opt_chunk      = 0;      /* I.e., work it out per transfer.    */
+static int64_t opt_chunk_max  = 256 * 1024;
+static int64_t opt_flags      = 0;      /* TEN4_SF_* bits for every transfer. */
+static int64_t opt_advise_win = 1024 * 1024;       /* For TEN4_SF_RDADVISE.   */
+static int64_t opt_nocache_min = 64 * 1024 * 1024; /* For TEN4_SF_NOCACHE.    */
+static int64_t opt_vcache     = 0;      /* Remember validated descriptors?    */
+static int64_t opt_cache_max  = 0;      /* Content cache size (0 = none).     */
+static int64_t opt_cache_file = 1024 * 1024;  /* Largest file it will take.   */
+static int64_t opt_native     = 1;      /* Use the kernel's, if it has one.   */
+static int64_t opt_gather_min = 0;      /* Pieces to copy together (0 = no).  */
+static int64_t opt_sndbuf_min = 1024 * 1024;  /* For TEN4_SF_SNDBUF.          */
+static int64_t opt_sndbuf_max = 256 * 1024;
+static int64_t opt_pace_rate  = 0;      /* Octets/second, all paced (0 = no). */
+static int64_t opt_pace_burst = 64 * 1024;
+
+static void cache_trim(void);
+static void trace_open(const char *);
+static void pick_gather(void);
+
+/* load_config():                                                             *
+ * Applies any settings given in the environment, once per process, before    *
+ * anything else reads or writes them.  A malformed value is ignored.         */
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+static void
+load_config(void)
+{ const char *text = getenv("TEN4SENDFILE_CHUNK");
+        char *end;
+   long long  value;
+  if (text != NULL && *text != '\0')
+  { value = strtoll(text, &end, 10);
+    if (*end == '\0' && value >= 0) opt_chunk = value;
+  }
+  if ((text = getenv("TEN4SENDFILE_TRACE")) != NULL && *text != '\0')
+    trace_open(text);
+  pick_gather();
+} /* end of load_config()                                                     */
+
+
+/* Per-thread state:                                                          *
+ * Anything a thread should keep between calls, rather than recreate on each  *
+ * one.  Allocated on the thread's first use, & freed when the thread exits.  */
+#define POOL_SLOTS 4  /* Idle transfer buffers a thread may hang on to.       */
+
+typedef struct {
+    void *base;  /* A page-aligned buffer from valloc(), or NULL.             */
+  size_t  size;  /* Its capacity.                                             */
+} Ten4_Buf;
+
+typedef struct ten4_tls {
+         int kq;                /* The thread's private kqueue, or -1 if it   *
+                                 * has none (yet).                            */
+    Ten4_Buf pool[POOL_SLOTS];  /* Buffers left over from earlier transfers.  */
+  Ten4_Stats stats;             /* This thread's share of the statistics.     */
+         int trace_ring;        /* 1 + the index of the thread's trace ring,  *
+                                 * 0 if it has yet to ask, or -1 if none was  *
+                                 * free.                                      */
+  Ten4_TraceRec *trace;         /* The record for the sendfile() call under   *
+                                 * way, if it is being traced, else NULL.     */
+         int trace_now;         /* The TEN4_PH_* phase it is in, &            */
+     Timeval trace_mark;        /*   when that began.                         */
+    uint64_t trace_base[4];     /* Its syscall & retry counts at the start.   */
+  struct ten4_tls *prev, *next; /* Links in the list of all threads' states.  */
+} Ten4_Tls;
+
+static void trace_release(int);
+
+static pthread_key_t  tls_key;
+static pthread_once_t tls_once = PTHREAD_ONCE_INIT;
+static int            tls_ok   = 0;  /* Whether the key creation succeeded.   */
+
+/* Every live thread's state is on one list, so that ten4_sendfile_stats()    *
+ * can sum their counts; those of threads that have exited are kept apart.    */
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static Ten4_Tls       *tls_list = NULL;
+static Ten4_Stats      stats_gone;  /* Counts from threads no longer running. */
+static Ten4_Stats      stats_base;  /* The totals as of the last reset.       */
+
+/* stats_add():                                                               *
+ * Adds the counts in {*from} to those in {*to}, or takes them away if {sign} *
+ * is negative.  Every member being a {uint64_t}, it need not name them.      */
+static void
+stats_add(Ten4_Stats *to, const Ten4_Stats *from, int sign)
+{       uint64_t *t = (uint64_t *) to;
+  const uint64_t *f = (const uint64_t *) from;
+  for (size_t i = 0; i < sizeof(Ten4_Stats) / sizeof(uint64_t); i++)
+    t[i] = (sign < 0 ? t[i] - f[i] : t[i] + f[i]);
+} /* end of stats_add()                                                       */
+
+static void
+tls_destroy(void *p)
+{ Ten4_Tls *tls = p;
+  pthread_mutex_lock(&tls_lock);
+  stats_add(&stats_gone, &tls->stats, 1);
+  if (tls->trace_ring > 0) trace_release(tls->trace_ring - 1);
+  if (tls->prev != NULL) tls->prev->next = tls->next;
+  else tls_list = tls->next;
+  if (tls->next != NULL) tls->next->prev = tls->prev;
+  pthread_mutex_unlock(&tls_lock);
+  if (tls->kq >= 0) close(tls->kq);
+  for (int i = 0; i < POOL_SLOTS; i++) free(tls->pool[i].base);
+  free(tls);
+} /* end of tls_destroy()                                                     */
+
+static void
+tls_init(void)
+{ tls_ok = (pthread_key_create(&tls_key, tls_destroy) == 0); }
+
+/* thread_state():                                                            *
+ * Returns the calling thread's state block, creating it if need be.  NULL is *
+ * returned only if memory is exhausted, which callers must survive.          */
+static Ten4_Tls *
+thread_state(void)
+{ Ten4_Tls *tls;
+  pthread_once(&tls_once, tls_init);
+  if (! tls_ok) return NULL;
+  tls = pthread_getspecific(tls_key);
+  if (tls == NULL && (tls = calloc(1, sizeof(Ten4_Tls))) != NULL)
+  { tls->kq = -1;
+    if (pthread_setspecific(tls_key, tls)) { free(tls);  return NULL; }
+    pthread_mutex_lock(&tls_lock);
+    if ((tls->next = tls_list) != NULL) tls_list->prev = tls;
+    tls_list = tls;
+    pthread_mutex_unlock(&tls_lock);
+  }
+  return tls;
+} /* end of thread_state()                                                    */
+
+/* STAT():                                                                    *
+ * Adds {n} to the calling thread's count {field}.  Only the owning thread    *
+ * ever writes its counts, so this needs neither a lock nor an atomic add     *
+ * (which Mac OS 10.3 lacks).  Should the thread have no state block, the     *
+ * count is simply lost.                                                      */
+#define STAT(field, n)                                                        \
+  do { Ten4_Tls *stat_tls = thread_state();                                   \
+       if (stat_tls != NULL) stat_tls->stats.field += (uint64_t) (n);         \
+  } while (0)
+
+
+/* pool_get():                                                                *
+ * Hands out a page-aligned buffer of at least {*size} octets, preferring the *
+ * smallest suitable one from the calling thread's pool to a fresh valloc().  *
+ * New buffers are sized in powers of two, so that they suit later requests.  *
+ * Updates {*size} to the buffer's full capacity.  Returns NULL if memory is  *
+ * exhausted.                                                                 */
+static void *
+pool_get(size_t *size)
+{ Ten4_Tls *tls  = thread_state();
+    size_t  want = 4096;
+      void *base;
+       int  best = -1;
+  if (tls != NULL)
+  { for (int i = 0; i < POOL_SLOTS; i++)
+      if (tls->pool[i].base != NULL && tls->pool[i].size >= *size
+          && (best < 0 || tls->pool[i].size < tls->pool[best].size))
+        best = i;
+    if (best >= 0)
+    { base  = tls->pool[best].base;  *size = tls->pool[best].size;
+      tls->pool[best].base = NULL;
+      return base;
+    }
+  }
+  while (want < *size) want <<= 1;
+  if ((base = valloc(want)) != NULL) *size = want;
+  return base;
+} /* end of pool_get()                                                        */
+
+
+/* pool_put():                                                                *
+ * Takes back a buffer from pool_get().  It goes into the calling thread's    *
+ * pool (which need not be the one it came from) if there is room, replacing  *
+ * a smaller one if need be; otherwise it is freed.                           */
+static void
+pool_put(void *base, size_t size)
+{ Ten4_Tls *tls = thread_state();
+       int  slot = -1;
+  if (base == NULL) return;
+  if (tls != NULL)
+  { for (int i = 0; i < POOL_SLOTS; i++)
+      if (tls->pool[i].base == NULL) { slot = i;  break; }
+      else if (tls->pool[i].size < size
+               && (slot < 0 || tls->pool[i].size < tls->pool[slot].size))
+        slot = i;
+    if (slot >= 0)
+    { free(tls->pool[slot].base);
+      tls->pool[slot].base = base;  tls->pool[slot].size = size;
+      return;
+    }
+  }
+  free(base);
+} /* end of pool_put()                                                        */
+
+
+/* usecs_since():                                                             *
+ * Returns the microseconds elapsed since {*then}, and updates {*then} to the *
+ * present.  A clock stepped backwards reads as no time having passed.  (Mac  *
+ * OS 10.4 has no clock_gettime(), but gettimeofday() is served from the comm *
+ * page there, so is cheap.)                                                  */
+static int64_t
+usecs_since(Timeval *then)
+{ Timeval now;
+  int64_t elapsed;
+  gettimeofday(&now, NULL);
+  elapsed = (int64_t) (now.tv_sec - then->tv_sec) * 1000000
+            + (now.tv_usec - then->tv_usec);
+  *then = now;
+  return (elapsed > 0 ? elapsed : 0);
+} /* end of usecs_since()                                                     */
+
+/* usecs_now():                                                               *
+ * Returns the time of day, in microseconds.                                  */
+static int64_t
+usecs_now(void)
+{ Timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t) now.tv_sec * 1000000 + now.tv_usec;
+} /* end of usecs_now()                                                       */
+
+/* stat_latency():                                                            *
+ * Counts a call begun at {*start} in the latency histogram.  Leaves {errno}  *
+ * alone, so may be called on the way out of a failing call.                  */
+static void
+stat_latency(Timeval *start)
+{ int64_t usecs  = usecs_since(start);
+      int bucket = 0,
+          saved  = errno;
+  while (usecs > 1 && bucket < TEN4_LAT_BUCKETS - 1) { usecs >>= 1;  bucket++; }
+  STAT(latency[bucket], 1);
+  errno = saved;
+} /* end of stat_latency()                                                    */
+
+
+/* The trace file, for TEN4SENDFILE_TRACE:                                    *
+ * Laid out as the header describes, & mapped for as long as the process      *
+ * lives.  Which rings are taken, & how many records each has had, is kept    *
+ * here rather than in the file; both are guarded by {tls_lock}, though only  *
+ * the owner of a ring ever touches its count while it is taken.              */
+static char     *trace_map = NULL;   /* The mapped file, if tracing.          */
+static int       trace_on  = 0;      /* Whether it is.                        */
+static char      trace_taken[TEN4_TRACE_RINGS];
+static uint64_t  trace_seq[TEN4_TRACE_RINGS];
+
+/* trace_open():                                                              *
+ * Creates the trace file at {path} & maps it, from load_config().  Failing   *
+ * that, tracing is quietly left off.                                         */
+static void
+trace_open(const char *path)
+{ Ten4_TraceHdr *hdr;
+         size_t  size = sizeof(Ten4_TraceHdr) + (size_t) TEN4_TRACE_RINGS
+                        * TEN4_TRACE_SLOTS * sizeof(Ten4_TraceRec);
+            int  fd;
+           void *map;
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) return;
+  if (ftruncate(fd, (off_t) size) == 0
+      && (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+         != MAP_FAILED)
+  { hdr = map;  /* A fresh file is all zeroes, so every slot starts unused.   */
+    memcpy(hdr->magic, TEN4_TRACE_MAGIC, sizeof(hdr->magic));
+    hdr->rec_size = sizeof(Ten4_TraceRec);
+    hdr->rings    = TEN4_TRACE_RINGS;
+    hdr->slots    = TEN4_TRACE_SLOTS;
+    hdr->pid      = (uint32_t) getpid();
+    trace_map = map;  trace_on = 1;
+  }
+  close(fd);
+} /* end of trace_open()                                                      */
+
+/* trace_release():                                                           *
+ * Frees ring {ring} for another thread, when its owner exits.  The caller    *
+ * must hold {tls_lock}.                                                      */
+static void
+trace_release(int ring)
+{ trace_taken[ring] = 0; }
+
+/* trace_begin():                                                             *
+ * Starts tracing a sendfile() call that began at {*start}, into {*rec}, if   *
+ * the calling thread has (or can get) a ring.                                */
+static void
+trace_begin(Ten4_TraceRec *rec, int fd, int sd, off_t offset, off_t asked,
+            Timeval *start)
+{ Ten4_Tls *tls = thread_state();
+  if (tls == NULL) return;
+  if (tls->trace_ring == 0)
+  { tls->trace_ring = -1;
+    pthread_mutex_lock(&tls_lock);
+    for (int i = 0; i < TEN4_TRACE_RINGS; i++)
+      if (! trace_taken[i])
+      { trace_taken[i] = 1;  tls->trace_ring = i + 1;  break; }
+    pthread_mutex_unlock(&tls_lock);
+  }
+  if (tls->trace_ring < 0) return;
+  memset(rec, 0, sizeof(*rec));
+  rec->when   = (uint64_t) start->tv_sec * 1000000 + start->tv_usec;
+  rec->fd     = fd;      rec->sd    = sd;
+  rec->offset = offset;  rec->asked = asked;
+  tls->trace_base[0] = tls->stats.sys_read;
+  tls->trace_base[1] = tls->stats.sys_send;
+  tls->trace_base[2] = tls->stats.sys_writev;
+  tls->trace_base[3] = tls->stats.eagain + tls->stats.emsgsize;
+  tls->trace_now  = TEN4_PH_VALIDATE;
+  tls->trace_mark = *start;
+  tls->trace = rec;
+} /* end of trace_begin()                                                     */
+
+/* trace_phase():                                                             *
+ * Ends the current phase of the call being traced, if there is one, charging *
+ * it with the time since it began, & starts phase {phase}.  Costs a single   *
+ * test when tracing is off.                                                  */
+static void
+trace_phase(int phase)
+{ Ten4_Tls *tls;
+  if (! trace_on || (tls = thread_state()) == NULL || tls->trace == NULL)
+    return;
+  tls->trace->usecs[tls->trace_now] += (uint32_t) usecs_since(&tls->trace_mark);
+  tls->trace_now = phase;
+} /* end of trace_phase()                                                     */
+
+/* trace_end():                                                               *
+ * Finishes the record of the call being traced, if there is one, charging    *
+ * what time is left to the phase it ended in, & writes it into the next slot *
+ * of the thread's ring.  Leaves {errno} alone.                               */
+static void
+trace_end(int result, off_t sent, int native)
+{ Ten4_TraceRec *rec,
+                *slot;
+       Ten4_Tls *tls;
+        Timeval  now;
+            int  ring,
+                 saved = errno;
+  if (! trace_on || (tls = thread_state()) == NULL
+      || (rec = tls->trace) == NULL)
+    return;
+  tls->trace = NULL;
+  ring = tls->trace_ring - 1;
+  rec->usecs[tls->trace_now] += (uint32_t) usecs_since(&tls->trace_mark);
+  now = tls->trace_mark;  /* I.e., the present.                               */
+  rec->usecs_total = (uint32_t) ((uint64_t) now.tv_sec * 1000000 + now.tv_usec
+                                 - rec->when);
+  rec->sent       = sent;
+  rec->error      = (result ? saved : 0);
+  rec->native     = (uint32_t) native;
+  rec->sys_read   = (uint32_t) (tls->stats.sys_read   - tls->trace_base[0]);
+  rec->sys_send   = (uint32_t) (tls->stats.sys_send   - tls->trace_base[1]);
+  rec->sys_writev = (uint32_t) (tls->stats.sys_writev - tls->trace_base[2]);
+  rec->retries    = (uint32_t) (tls->stats.eagain + tls->stats.emsgsize
+                                - tls->trace_base[3]);
+  /* Fill the slot in, then stamp it, so that a reader of the live file can   *
+   * tell a used slot from one caught half-written (mostly; nothing orders    *
+   * the stores on a multiprocessor, but this is only a diagnostic).          */
+  slot = (Ten4_TraceRec *) (trace_map + sizeof(Ten4_TraceHdr))
+         + (size_t) ring * TEN4_TRACE_SLOTS
+         + trace_seq[ring] % TEN4_TRACE_SLOTS;
+  slot->seq = 0;
+  rec->seq  = 0;
+  memcpy(slot, rec, sizeof(*rec));
+  slot->seq = ++trace_seq[ring];
+  errno = saved;
+} /* end of trace_end()                                                       */
+
+
+/* wait_writable():                                                           *
+ * The wait engine.  Blocks until socket {sd} can accept more data, or until  *
+ * {*budget} (in microseconds; negative means unlimited) runs out.  The time  *
+ * actually spent is deducted from {*budget}.  With {sd} negative, it simply  *
+ * naps for up to a millisecond, for conditions (e.g. ENOBUFS) whose end the  *
+ * kernel will not report.  Returns 0 when it is worth trying again, or       *
+ * -1 with {errno} set to EAGAIN (budget exhausted) or EINTR (interrupted by  *
+ * a signal).  Errors on {sd} itself are reported as writability, so that the *
+ * retried send() can surface them with its own, more accurate, errno.        */
+static int
+wait_writable(int sd, int64_t *budget)
+{ int64_t  limit = *budget;  /* How long this one wait may take, in usec.     */
+  Timeval  start;
+      int  result;
+  if (limit == 0) { errno = EAGAIN;  return -1; }
+  if (sd < 0 && (limit < 0 || limit > 1000)) limit = 1000;
+  gettimeofday(&start, NULL);
+#ifdef TEN4_HAVE_KQUEUE
+  { Ten4_Tls *tls = thread_state();
+    if (tls != NULL && tls->kq < 0) tls->kq = kqueue();
+    if (tls != NULL && tls->kq >= 0)
+    { struct kevent change, event;
+           Timespec  timeout,
+                    *tp = NULL;
+      if (limit >= 0)
+      { timeout.tv_sec  = limit / 1000000;
+        timeout.tv_nsec = (limit % 1000000) * 1000;
+        tp = &timeout;
+      }
+      if (sd >= 0)
+        EV_SET(&change, sd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+      result = kevent(tls->kq, &change, (sd >= 0 ? 1 : 0), &event, 1, tp);
+      if (result > 0)
+        goto waited;  /* (A stray event just makes for a spurious wakeup.)    */
+      if (result == 0 || errno == EINTR)
+      { /* The one-shot never fired, so take it back out again, lest it turn  *
+         * up at some later wait on another socket.                           */
+        if (sd >= 0)
+        { int saved = errno;
+          EV_SET(&change, sd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+          kevent(tls->kq, &change, 1, NULL, 0, NULL);
+          errno = saved;
+        }
+        goto waited;
+      }
+      /* Any other failure means the kqueue itself has gone bad (e.g., after  *
+       * a fork()), so drop it & fall back to poll().                         */
+      close(tls->kq);  tls->kq = -1;
+    }
+  }
+#endif
+  { struct pollfd pfd;
+              int msecs = (limit < 0 ? -1
+                           : limit >= (int64_t) INT_MAX * 1000 ? INT_MAX
+                           : (int) ((limit + 999) / 1000));
+    pfd.fd = sd;  pfd.events = POLLOUT;  pfd.revents = 0;
+    result = poll(&pfd, (sd >= 0 ? 1 : 0), msecs);
+  }
+#ifdef TEN4_HAVE_KQUEUE
+waited:
+#endif
+  { int64_t waited = usecs_since(&start);
+    STAT(stall_usecs, waited);
+    if (*budget > 0 && (*budget -= waited) < 0) *budget = 0;
+  }
+  if (result < 0) return -1;  /* errno is EINTR; anything else is impossible. */
+  if (result == 0 && *budget == 0) { errno = EAGAIN;  return -1; }
+  return 0;
+} /* end of wait_writable()                                                   */
+
+
+/* Pacing, for TEN4_OPT_PACE_RATE & ten4_sendfile_pace():                     *
+ * A paced transfer's file data is paid for out of a token bucket - its own,  *
+ * the process-wide one, or both - that fills at the rate set, holding up to  *
+ * TEN4_OPT_PACE_BURST octets.  Each chunk is cut down to what the buckets    *
+ * can pay for; when that is under a quarter of the burst (or of the chunk),  *
+ * the transfer waits for them to fill.  A bucket can go into debt, when      *
+ * transfers sharing the global one each spend the same tokens, but that only *
+ * makes the next wait longer.  Transfers no bigger than the burst are never  *
+ * paced at all.                                                              */
+static pthread_mutex_t pace_lock   = PTHREAD_MUTEX_INITIALIZER;
+static int64_t         pace_tokens = 0;  /* The global bucket's contents, &   */
+static int64_t         pace_stamp  = 0;  /*   when it was last topped up.     */
+
+/* bucket_fill():                                                             *
+ * Tops up the bucket holding {*tokens}, last topped up at {*stamp} (or never *
+ * if that is 0), for the time until {now} at {rate} octets per second.       */
+static void
+bucket_fill(int64_t *tokens, int64_t *stamp, int64_t rate, int64_t now)
+{ double add = (double) (now - *stamp) * (double) rate / 1e6;
+  if (*stamp == 0 || (double) *tokens + add >= (double) opt_pace_burst)
+    *tokens = opt_pace_burst;
+  else if (add >= 1)  /* Else leave the time to build up to a whole token.    */
+    *tokens += (int64_t) add;
+  else
+    return;
+  *stamp = now;
+} /* end of bucket_fill()                                                     */
 
-const Timespec a_third     = {0, 16666667};  /* 1/60 second = one "third".    */
-const uint32_t MAX_RETRIES = 50;
+/* pace_nap():                                                                *
+ * Sleeps for {usecs} microseconds, in the wait engine's kqueue where there   *
+ * is one, so that the thread stays as responsive as it would be waiting on a *
+ * socket; an early wakeup just means the tokens are counted again sooner.    *
+ * Returns 0, or -1 with {errno} = EINTR.                                     */
+static int
+pace_nap(int64_t usecs)
+{ Timeval start;
+      int result;
+  gettimeofday(&start, NULL);
+#ifdef TEN4_HAVE_KQUEUE
+  { Ten4_Tls *tls = thread_state();
+    if (tls != NULL && tls->kq < 0) tls->kq = kqueue();
+    if (tls != NULL && tls->kq >= 0)
+    { struct kevent event;
+           Timespec timeout;
+      timeout.tv_sec  = usecs / 1000000;
+      timeout.tv_nsec = (usecs % 1000000) * 1000;
+      result = kevent(tls->kq, NULL, 0, &event, 1, &timeout);
+      if (result >= 0 || errno == EINTR) goto napped;
+    }
+  }
+#endif
+  result = poll(NULL, 0, (usecs >= (int64_t) INT_MAX * 1000 ? INT_MAX
+                          : (int) ((usecs + 999) / 1000)));
+#ifdef TEN4_HAVE_KQUEUE
+napped:
+#endif
+  STAT(pace_usecs, usecs_since(&start));
+  return (result < 0 ? -1 : 0);  /* errno is EINTR.                           */
+} /* end of pace_nap()                                                        */
+
+/* pace():                                                                    *
+ * Cuts the {*want} file octets that {*ctx} is about to send down to what its *
+ * buckets can pay for.  If that is too little to be worth sending, it first  *
+ * waits for them to fill - or, on a nonblocking socket, fails with EAGAIN,   *
+ * having set ctx->pace_due to when it will be worth trying again.  Returns   *
+ * 0, or -1 with {errno} = EAGAIN or EINTR.                                   */
+static int
+pace(Ten4_Ctx *ctx, off_t *want)
+{ int64_t quarter = (opt_pace_burst > 4 ? opt_pace_burst / 4 : 1),
+          need    = (*want < quarter ? *want : quarter);
+  if (! ctx->paced) return 0;
+  for (;;)
+  { int64_t now   = usecs_now(),
+            avail = *want,
+            wait  = 0;
+    if (ctx->pace_rate > 0)
+    { bucket_fill(&ctx->pace_tokens, &ctx->pace_stamp, ctx->pace_rate, now);
+      if (ctx->pace_tokens < avail) avail = ctx->pace_tokens;
+      if (ctx->pace_tokens < need)
+        wait = (need - ctx->pace_tokens) * 1000000 / ctx->pace_rate + 1;
+    }
+    if (opt_pace_rate > 0)
+    { int64_t rate = opt_pace_rate;  /* In case it changes meanwhile.         */
+      pthread_mutex_lock(&pace_lock);
+      bucket_fill(&pace_tokens, &pace_stamp, rate, now);
+      if (pace_tokens < avail) avail = pace_tokens;
+      if (pace_tokens < need
+          && (need - pace_tokens) * 1000000 / rate + 1 > wait)
+        wait = (need - pace_tokens) * 1000000 / rate + 1;
+      pthread_mutex_unlock(&pace_lock);
+    }
+    if (wait == 0) { *want = avail;  return 0; }
+    STAT(pace_waits, 1);
+    if (ctx->nonblocking)
+    { ctx->pace_due = now + wait;  errno = EAGAIN;  return -1; }
+    if (pace_nap(wait)) return -1;
+  }
+} /* end of pace()                                                            */
+
+/* pace_charge():                                                             *
+ * Takes the {sent} file octets that {*ctx} has just sent out of its buckets. */
+static void
+pace_charge(Ten4_Ctx *ctx, off_t sent)
+{ if (! ctx->paced) return;
+  if (ctx->pace_rate > 0) ctx->pace_tokens -= sent;
+  if (opt_pace_rate > 0)
+  { pthread_mutex_lock(&pace_lock);
+    pace_tokens -= sent;
+    pthread_mutex_unlock(&pace_lock);
+  }
+} /* end of pace_charge()                                                     */
+
+
+/* ten4_sendfile_setopt() & ten4_sendfile_getopt():                           *
+ * Change & report the tunables listed in the header.  Both return 0 on       *
+ * success; given an unknown option, they set {errno} to EINVAL & return -1.  */
+int
+ten4_sendfile_setopt(int option, int64_t value)
+{ pthread_once(&config_once, load_config);
+  switch (option)
+  { case TEN4_OPT_TIMEOUT:    opt_timeout_ms = value;  return 0;
+    case TEN4_OPT_COALESCE:   opt_coalesce   = value;  return 0;
+    case TEN4_OPT_CHUNK:
+      if (value < 0) break;
+      opt_chunk = value;  return 0;
+    case TEN4_OPT_CHUNK_MAX:
+      if (value < 1) break;
+      opt_chunk_max = value;  return 0;
+    case TEN4_OPT_FLAGS:
+      if (value & ~TEN4_SF_ALL) break;
+      opt_flags = value;  return 0;
+    case TEN4_OPT_ADVISE_WINDOW:
+      if (value < 1 || value > INT_MAX) break;  /* F_RDADVISE takes an {int}. */
+      opt_advise_win = value;  return 0;
+    case TEN4_OPT_NOCACHE_MIN:  opt_nocache_min = value;  return 0;
+    case TEN4_OPT_NATIVE:       opt_native = (value != 0);  return 0;
+    case TEN4_OPT_VCACHE:
+      if ((opt_vcache = (value != 0)) == 0) ten4_sendfile_forget(-1);
+      return 0;
+    case TEN4_OPT_CACHE_MAX:
+      if (value < 0) break;
+      opt_cache_max = value;  cache_trim();  return 0;
+    case TEN4_OPT_CACHE_FILE_MAX:
+      if (value < 0) break;
+      opt_cache_file = value;  return 0;
+    case TEN4_OPT_GATHER_MIN:
+      if (value < 0) break;
+      opt_gather_min = value;  return 0;
+    case TEN4_OPT_SNDBUF_MIN:  opt_sndbuf_min = value;  return 0;
+    case TEN4_OPT_SNDBUF_MAX:
+      if (value < 1 || value > INT_MAX) break;  /* SO_SNDBUF is an {int}.     */
+      opt_sndbuf_max = value;  return 0;
+    case TEN4_OPT_PACE_RATE:
+      if (value < 0) break;
+      opt_pace_rate = value;  return 0;
+    case TEN4_OPT_PACE_BURST:
+      if (value < 1) break;
+      opt_pace_burst = value;  return 0;
+  }
+  errno = EINVAL;  return -1;
+} /* end of ten4_sendfile_setopt()                                            */
+
+int
+ten4_sendfile_getopt(int option, int64_t *value)
+{ if (value == NULL) { errno = EFAULT;  return -1; }
+  pthread_once(&config_once, load_config);
+  switch (option)
+  { case TEN4_OPT_TIMEOUT:    *value = opt_timeout_ms;  return 0;
+    case TEN4_OPT_COALESCE:   *value = opt_coalesce;    return 0;
+    case TEN4_OPT_CHUNK:      *value = opt_chunk;       return 0;
+    case TEN4_OPT_CHUNK_MAX:  *value = opt_chunk_max;   return 0;
+    case TEN4_OPT_FLAGS:      *value = opt_flags;       return 0;
+    case TEN4_OPT_ADVISE_WINDOW:  *value = opt_advise_win;   return 0;
+    case TEN4_OPT_NOCACHE_MIN:    *value = opt_nocache_min;  return 0;
+    case TEN4_OPT_NATIVE:     *value = opt_native;      return 0;
+    case TEN4_OPT_VCACHE:     *value = opt_vcache;      return 0;
+    case TEN4_OPT_CACHE_MAX:  *value = opt_cache_max;   return 0;
+    case TEN4_OPT_CACHE_FILE_MAX:  *value = opt_cache_file;  return 0;
+    case TEN4_OPT_GATHER_MIN:      *value = opt_gather_min;  return 0;
+    case TEN4_OPT_SNDBUF_MIN:      *value = opt_sndbuf_min;  return 0;
+    case TEN4_OPT_SNDBUF_MAX:      *value = opt_sndbuf_max;  return 0;
+    case TEN4_OPT_PACE_RATE:       *value = opt_pace_rate;   return 0;
+    case TEN4_OPT_PACE_BURST:      *value = opt_pace_burst;  return 0;
+    default:  errno = EINVAL;  return -1;
+  }
+} /* end of ten4_sendfile_getopt()                                            */
 
 
 /* check_iovv():                                                              *
@@ -71,7 +779,7 @@ const uint32_t MAX_RETRIES = 50;
  * number of octets delineated by the array.  The return value is a {ssize_t},*
  * which is ultimately defined as a {long}, thus is either 32 or 64 bits wide *
  * depending on whether LP64 mode is active.                                  */
-ssize_t
+static ssize_t
 check_iovv(IOVec varray[],  /* A variable-length array of {IOVec}.            */
              int n_el       /* The number of elements in the array.           */
           )
@@ -87,35 +795,83 @@ check_iovv(IOVec varray[],  /* A variable-length array of {IOVec}.            */
 } /* end of check_iovv()                                                      */
 
 
+/* advance_iovv():                                                            *
+ * Moves a position in a variable-length IOVec array, held by reference as a  *
+ * pointer to its first unsent member, that member's count of octets already  *
+ * sent ({*skip}), & the count of members left, past another {done} octets.   *
+ * The members themselves are never written to.  Returns 0, or, if the array  *
+ * held fewer than {done} octets, sets {errno} to EINVAL and returns -1.      */
+static int
+advance_iovv(IOVec **iovv,  /* Variable-length {IOVec} vector, by reference.  */
+               int *n_el,   /* Number of elements in the vector, by reference.*/
+            size_t *skip,   /* Octets of (*iovv)[0] already sent, by ref.     */
+            size_t  done    /* How many more octets have been dealt with.     */
+            )
+{ done += *skip;  *skip = 0;
+  while (*n_el > 0 && (**iovv).iov_len <= done)  /* Can advance to next IOVec.*/
+  { done -= (**iovv).iov_len;
+    (*iovv)++;       /* This should add sizeof(IOVec) to the pointer.         */
+    (*n_el)--;
+  } /* end of the "inching up the vector" while loop                          */
+  if (done == 0) return 0;
+  if (*n_el < 1) { errno = EINVAL;  return -1; }  /* No more IOVecs?!         */
+  *skip = done;  /* Record how far into the unfinished member we got.         */
+  return 0;
+} /* end of advance_iovv()                                                    */
+
+
+/* writev() refuses arrays longer than IOV_MAX, so longer ones go in slices.  *
+ * After a partial write, the rest of the member it stopped in is sent from a *
+ * trimmed copy, along with up to SPOOL_RESUME - 1 members after it; a socket *
+ * that just filled up will hardly take more than that in one go anyway.      */
+#ifndef IOV_MAX
+#define IOV_MAX      1024
+#endif
+#define SPOOL_RESUME 64
+
 /* spool_iovv():                                                              *
  * For streaming a variable-length IOVec array to a socket.  If the streaming *
- * gets interrupted, it adjusts the IOVec array to still accurately represent *
- * the data not yet sent.                                                     */
-int
-spool_iovv(  int   sd,    /* A streaming socket descriptor.                   */
-           IOVec **iovv,  /* Variable-length {IOVec} vector, by reference.    */
-             int  *n_el,  /* Number of elements in the vector, by reference.  */
-           off_t  *len    /* Signed {int64} ref for number of octets written. */
+ * gets interrupted, it moves the position held in {*iovv}, {*n_el} & {*skip} *
+ * (see advance_iovv()) to mark the data not yet sent, leaving the members of *
+ * the array untouched.  Each writev() is given at most IOV_MAX members.      *
+ * Time spent waiting for the socket to drain comes out of {*budget}, as      *
+ * described at wait_writable().                                              */
+static int
+spool_iovv(  int   sd,     /* A streaming socket descriptor.                  */
+           IOVec **iovv,   /* Variable-length {IOVec} vector, by reference.   */
+             int  *n_el,   /* Number of elements in the vector, by reference. */
+          size_t  *skip,   /* Octets of (*iovv)[0] already sent, by reference.*/
+           off_t  *len,    /* Signed {int64} ref for number of octets written.*/
+         int64_t  *budget  /* Microseconds left to spend waiting.             */
           )
-{  ssize_t result    = 0,
-           left_2_go = check_iovv(*iovv, *n_el); /* Amount left to stream.    */
-    size_t _result;        /* For comparisons to unsigned size_t values.      */
-  uint32_t retries   = 0;  /* For pre-emptions and interruptions.             */
+{  ssize_t result    = 0;
+     IOVec resume[SPOOL_RESUME];  /* The trimmed copy, after partial writes.  */
   *len = 0;
-  if (left_2_go < 0) return -1;  /* check_iovv() already set {errno} to suit. */
-  while (left_2_go > 0)  /* Note an initial left_2_go of 0 will bypass this.  */
-  { result = writev(sd, *iovv, *n_el);
+  if (*iovv == NULL && *n_el > 0) { errno = EFAULT;  return -1; }
+  while (*n_el > 0)  /* Note an initial *n_el of 0 will bypass this.          */
+  { IOVec *first = *iovv;  /* Where this call's slice of the array begins.    */
+      int  n     = *n_el;   /* How many members the slice holds.              */
+    if (*skip == 0)
+    { if (n > IOV_MAX) n = IOV_MAX;
+      result = writev(sd, *iovv, n);
+    }
+    else
+    { if (n > SPOOL_RESUME) n = SPOOL_RESUME;
+      memcpy(resume, *iovv, n * sizeof(IOVec));
+      resume[0].iov_base = (char *) resume[0].iov_base + *skip;
+      resume[0].iov_len -= *skip;
+      result = writev(sd, resume, n);
+    }
+    STAT(sys_writev, 1);
     /* Function prototype here is ssize_t writev(int s, const IOVec a, int n).
-       writev() does all our actual work but doesn't adjust the IOVec data to
-       reflect partial progress.                                              */
+       writev() does all our actual work but doesn't record partial progress.
+                                                                              */
     if (result < 0) /* writev() suffered an error.                            */
     { switch (errno)  /* Possible errors (given we've already validated) are: */
-      { case EAGAIN:
-        if (retries++ < MAX_RETRIES)  /* Usually transient; sleep & retry.    */
-        { if (nanosleep(&a_third, NULL) && errno == EINTR) break;
-          /* The other potential nanosleep() errors ought to be impossible.   */
+      { case EAGAIN:  /* Usually transient; wait for room, then retry.        */
+          STAT(eagain, 1);
+          if (wait_writable(sd, budget)) break;  /* errno is EAGAIN or EINTR. */
           continue;  /* In this case, no data was written; just pick up & go. */
-        } else break;  /* All those retries still weren't enough.  Give up.   */
         case EBADF:   case EFAULT:   case EINTR:   case EINVAL:   case EIO:
           break; /* We may return these same values, & for these same reasons.*/
         case EDESTADDRREQ:   case EPIPE:
@@ -125,26 +881,16 @@ spool_iovv(  int   sd,    /* A streaming socket descriptor.                   */
         default:  /* including case ENOBUFS                                   */
           errno = EIO;  break;
       } /* end of switch statement                                            */
-      return -1;  /* Safe; args were adjusted at end of prior loop iteration. */
+      return -1;  /* Safe; our place was moved at end of prior iteration.     */
     } /* end writev() error handling                                          */
     if (result)  /* We moved some data!  Yay!                                 */
     { *len += result;  /* Track how much we've moved in total.                */
-      left_2_go -= result;  /* Track how far is left to go.                   */
-      if (left_2_go > 0)
-      /* We didn't get it all, presumably due to being pre-empted/interrupted
-         in some manner.  Adjust the IOVec array before we loop to try again. */
-      { _result = (size_t) result;
-        while ((**iovv).iov_len <= _result)  /* Can advance to next IOVec.    */
-        { _result -= (**iovv).iov_len;
-          (*iovv)++;       /* This should add sizeof(IOVec) to the pointer.   */
-          (*n_el)--;
-          if (*n_el < 1) { errno = EINVAL;  return -1; }  /* No more IOVecs?! */
-        } /* end of the "inching up the vector" while loop                    */
-        if ((_result) && ((**iovv).iov_len > _result))  /* IOVec partly sent. */
-        { (**iovv).iov_len -= _result;  /* Record length of the unmoved data, */
-          (**iovv).iov_base += _result;  /* and its beginning.                */
-        }
-      } /* end of the "we didn't get it all" block                            */
+      STAT(bytes_writev, result);
+      /* Move our place in the array past what went, so that the next time
+         round (or the next call, if this one is cut short) starts from the
+         first octet not yet sent.                                            */
+      if (advance_iovv(iovv, n_el, skip, (size_t) result)) return -1;
+      if (*iovv < first + n) STAT(partial, 1);  /* Didn't take it all.        */
     } /* end of the "we got a result" block                                   */
   } /* end of the "there's still data left to stream" while loop              */
   return 0;
@@ -152,38 +898,42 @@ spool_iovv(  int   sd,    /* A streaming socket descriptor.                   */
 
 
 /* stubborn_send():                                                           *
- * Call send() until the whole of what was to be sent actually has been.      *
- * Returns 0 on success, and -1 (with errno set appropriately) otherwise.     */
-int
-stubborn_send(  char *bufr,  /* Data to send.                                 */
-             ssize_t *b_sz,  /* In:  Number of octets to send.                *
-                              * Out:  # octets sent (on error will be fewer). */
-                 int  sd     /* Descriptor of the socket to send to.          */
+ * Call send() until the whole of what was to be sent actually has been, or   *
+ * until the socket stays full for longer than {*budget} allows.  Returns 0   *
+ * on success, and -1 (with errno set appropriately) otherwise.               */
+static int
+stubborn_send(  char *bufr,   /* Data to send.                                */
+             ssize_t *b_sz,   /* In:  Number of octets to send.               *
+                               * Out:  # octets sent (on error will be fewer).*/
+                 int  sd,     /* Descriptor of the socket to send to.         */
+             int64_t *budget  /* Microseconds left to spend waiting.          */
              )
 {     char *buf_index  = bufr;   /* Read pointer into the input buffer.       */
    ssize_t  cumulative = 0,      /* How much has been moved overall.          */
             to_send    = *b_sz,  /* How much to try to send per call.         */
             result;              /* How much actually got sent per call.      */
-  uint32_t  retries    = 0;      /* How many times we have retried sending.   */
   /* Sanity checks:                                                           */
   if (bufr == NULL) { errno = EINVAL;  return -1; }
   if (to_send == 0) return 0;
 
   do
   { result = send(sd, buf_index, to_send, 0);
+    STAT(sys_send, 1);
     if (result < 0)
     { if (errno == EACCES || errno == EHOSTUNREACH)
       { /* Per the specs, we can't validly return either of those.            */
         errno = ENOTCONN;  *b_sz = cumulative;  return -1;
       } else if (errno == EAGAIN || errno == ENOBUFS)  /* Usually transient.  */
-      { if (retries++ < MAX_RETRIES)
-        { if (nanosleep(&a_third, NULL) && errno == EINTR)  /* Interrupted;   */
-          { *b_sz = cumulative;  return -1; }     /* is the caller's problem. */
-          continue;  /* Retry.                                                */
-        } else  /* All those retries still weren't enough.  Give up.          */
-        { errno = EAGAIN;  *b_sz = cumulative;  return -1; }
+      { if (errno == EAGAIN) STAT(eagain, 1);
+        /* A full socket can be waited on directly; an mbuf shortage can't,   *
+         * so for that we just nap briefly.  Either way, an interruption is   *
+         * the caller's problem, & running out of time means giving up.       */
+        if (wait_writable((errno == EAGAIN ? sd : -1), budget))
+        { *b_sz = cumulative;  return -1; }  /* errno is EAGAIN or EINTR.     */
+        continue;  /* Retry.                                                  */
       } else if (errno == EMSGSIZE)  /* Tried to send too much at once.       */
-      { if (to_send > 1500) to_send = 1500;  /* Try an Ethernet payload size. */
+      { STAT(emsgsize, 1);
+        if (to_send > 1500) to_send = 1500;  /* Try an Ethernet payload size. */
         else to_send = to_send * 3 >> 2;  /* Try a value 3/4 as big.          */
         continue;
       } else  /* Other errors are fatal, but do have safe errno values.       */
@@ -192,6 +942,7 @@ stubborn_send(  char *bufr,  /* Data to send.                                 */
     /* If we got this far, send() didn't error out on us.  Yay!               */
     if (result == 0) break;  /* We must be done, regardless of measurements.  */
     cumulative += result;
+    if (result < to_send) STAT(partial, 1);
     if (cumulative < *b_sz)
     { buf_index = &(bufr[cumulative]);
       /* Don't try to send more than we have available!                       */
@@ -203,95 +954,2386 @@ stubborn_send(  char *bufr,  /* Data to send.                                 */
 } /* end of stubborn_send()                                                   */
 
 
+
+/* unmap_window():                                                            *
+ * Releases the part of the file that {*ctx} has mapped, if any.              */
+static void
+unmap_window(Ten4_Ctx *ctx)
+{ if (ctx->map_base != NULL) munmap(ctx->map_base, ctx->map_len);
+  ctx->map_base = NULL;  ctx->map_len = 0;
+} /* end of unmap_window()                                                    */
+
+
+/* map_window():                                                              *
+ * Slides {*ctx}'s view of its file along, so that it starts at the page that *
+ * holds the next octet to send and spans up to MMAP_WINDOW octets, but none  *
+ * past the end of the range being sent.  Returns 0 on success, or -1 if the  *
+ * file could not be mapped (as on some network filesystems).                 */
+static int
+map_window(Ten4_Ctx *ctx)
+{ static long page_sz = 0;  /* Mappings must start on a page boundary.        */
+       off_t  start;
+      size_t  span;
+        void *base;
+  if (page_sz == 0) page_sz = sysconf(_SC_PAGESIZE);
+  unmap_window(ctx);
+  start = ctx->file_pos - ctx->file_pos % page_sz;
+  span  = (ctx->file_pos + ctx->file_left - start < (off_t) MMAP_WINDOW
+           ? (size_t) (ctx->file_pos + ctx->file_left - start) : MMAP_WINDOW);
+  base  = mmap(NULL, span, PROT_READ, MAP_SHARED, ctx->fd, start);
+  if (base == MAP_FAILED) return -1;
+  ctx->map_base = base;  ctx->map_off = start;  ctx->map_len = span;
+  return 0;
+} /* end of map_window()                                                      */
+
+
+/* tune_sndbuf():                                                             *
+ * For TEN4_SF_SNDBUF:  enlarges {*ctx}'s socket's send buffer to hold as     *
+ * much of the transfer as TEN4_OPT_SNDBUF_MAX allows, halving the request    *
+ * for as long as the kernel refuses it.  The old size is kept for            *
+ * ten4_sendfile_finish() to put back.  Returns the size now in effect, or 0  *
+ * if that is unknown.                                                        */
+static int
+tune_sndbuf(Ten4_Ctx *ctx)
+{     off_t total = ctx->hdr_len + ctx->file_left + ctx->trlr_len;
+        int have = 0,
+            want = (int) (total < opt_sndbuf_max ? total : opt_sndbuf_max);
+  socklen_t s_len = sizeof(have);
+  STAT(sys_sockopt, 1);
+  if (getsockopt(ctx->sd, SOL_SOCKET, SO_SNDBUF, &have, &s_len)) return 0;
+  for ( ; want > have; want /= 2)
+  { STAT(sys_sockopt, 1);
+    if (setsockopt(ctx->sd, SOL_SOCKET, SO_SNDBUF, &want, sizeof(want)) == 0)
+    { ctx->sndbuf = have;  return want; }
+  }
+  return have;
+} /* end of tune_sndbuf()                                                     */
+
+
+/* tune_lowat():                                                              *
+ * For TEN4_SF_SNDBUF:  raises the SO_SNDLOWAT of {*ctx}'s socket, whose send *
+ * buffer is {sndbuf} octets, to a chunk - but no more than half the buffer,  *
+ * lest it run dry before a wait ends - so that a blocked send is woken only  *
+ * once a useful amount will fit.  The old mark is kept, as for tune_sndbuf.  *
+ * Systems that do not let it be set (Linux) are simply left alone.           */
+static void
+tune_lowat(Ten4_Ctx *ctx, int sndbuf)
+{       int have = 0,
+            want = (ctx->chunk < (size_t) sndbuf / 2 ? (int) ctx->chunk
+                    : sndbuf / 2);
+  socklen_t s_len = sizeof(have);
+  STAT(sys_sockopt, 1);
+  if (getsockopt(ctx->sd, SOL_SOCKET, SO_SNDLOWAT, &have, &s_len)
+      || have >= want)
+    return;
+  STAT(sys_sockopt, 1);
+  if (setsockopt(ctx->sd, SOL_SOCKET, SO_SNDLOWAT, &want, sizeof(want)) == 0)
+    ctx->sndlowat = have;
+} /* end of tune_lowat()                                                      */
+
+
+/* choose_chunk():                                                            *
+ * Works out how many file octets {*ctx} should move per read & send.  That   *
+ * is the TEN4_OPT_CHUNK setting, if nonzero; otherwise, enough whole blocks  *
+ * of the file's filesystem to fill the socket's send buffer, but at least    *
+ * one.  It is capped by TEN4_OPT_CHUNK_MAX, & by the file data there is to   *
+ * move.  A transfer small enough to be coalesced needs no socket query, nor  *
+ * does one whose send buffer {sndbuf} (if positive) tune_sndbuf() just set.  */
+static size_t
+choose_chunk(Ten4_Ctx *ctx, blksize_t blksize, int sndbuf)
+{   int64_t chunk = opt_chunk;
+  socklen_t s_len = sizeof(sndbuf);
+  if (ctx->file_left == 0) return 0;
+  if (ctx->hdr_len + ctx->file_left + ctx->trlr_len <= opt_coalesce)
+    return (size_t) ctx->file_left;
+  if (chunk <= 0)
+  { if (blksize <= 0) blksize = 4096;
+    if (sndbuf <= 0)
+    { STAT(sys_sockopt, 1);
+      if (getsockopt(ctx->sd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &s_len))
+        sndbuf = 0;
+    }
+    chunk = sndbuf - sndbuf % blksize;
+    if (chunk < blksize) chunk = blksize;
+  }
+  if (chunk > opt_chunk_max)   chunk = opt_chunk_max;
+  if (chunk > ctx->file_left)  chunk = ctx->file_left;
+  return (size_t) chunk;
+} /* end of choose_chunk()                                                    */
+
+
+/* ensure_buffer():                                                           *
+ * Gives {*ctx} a pooled buffer of at least {want} octets, unless it has one  *
+ * already; one too small goes back to the pool first.  Returns 0, or -1      *
+ * with {errno} = ENOMEM.                                                     */
+static int
+ensure_buffer(Ten4_Ctx *ctx, size_t want)
+{ if (ctx->buf != NULL && ctx->buf_sz < want)
+  { pool_put(ctx->buf, ctx->buf_sz);  ctx->buf = NULL; }
+  if (ctx->buf == NULL)
+  { ctx->buf_sz = want;  ctx->buf_len = 0;
+    if ((ctx->buf = pool_get(&ctx->buf_sz)) == NULL)
+    { errno = ENOMEM;  return -1; }
+  }
+  return 0;
+} /* end of ensure_buffer()                                                   */
+
+
+/* advise_range():                                                            *
+ * Asks the kernel to start reading {count} octets of file {fd}, from offset  *
+ * {from}, into memory.  It is only advice, so failure is of no consequence.  */
+static void
+advise_range(int fd, off_t from, off_t count)
+{
+#if defined(F_RDADVISE)
+  struct radvisory advice;
+  advice.ra_offset = from;
+  advice.ra_count  = (int) (count < INT_MAX ? count : INT_MAX);
+  fcntl(fd, F_RDADVISE, &advice);
+  STAT(sys_fcntl, 1);
+#elif defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd, from, count, POSIX_FADV_WILLNEED);
+  STAT(sys_fcntl, 1);
+#else
+  (void) fd;  (void) from;  (void) count;
+#endif
+} /* end of advise_range()                                                    */
+
+
+/* advise_ahead():                                                            *
+ * For TEN4_SF_RDADVISE:  Keeps the kernel reading {*ctx}'s file at least     *
+ * half a TEN4_OPT_ADVISE_WINDOW ahead of the point being sent, by asking it  *
+ * for the next window (but nothing past the range) whenever it falls behind. *
+ * A range of only one chunk gets no advice; it would be mere overhead.       */
+static void
+advise_ahead(Ten4_Ctx *ctx)
+{ off_t from = (ctx->advised > ctx->file_pos ? ctx->advised : ctx->file_pos),
+        end  = ctx->file_pos + ctx->file_left;
+  if (! (ctx->flags & TEN4_SF_RDADVISE) || ctx->file_left <= (off_t) ctx->chunk
+      || from >= end || from - ctx->file_pos > opt_advise_win / 2)
+    return;
+  ctx->advised = (end - from > opt_advise_win ? from + opt_advise_win : end);
+  advise_range(ctx->fd, from, ctx->advised - from);
+} /* end of advise_ahead()                                                    */
+
+
+/* nodisk_avail():                                                            *
+ * For TEN4_SF_NODISKIO:  Returns how many of {*ctx}'s next file octets can   *
+ * be sent without waiting on the disk, or -1 with {errno} = EBUSY if none    *
+ * can, in which case the kernel is asked to read the next NODISK_PROBE       *
+ * octets in.  Residency is found with mincore() on a mapping of up to        *
+ * NODISK_PROBE octets, & remembered, so most calls make no system calls at   *
+ * all.  If it can't be found out, the file is sent as usual:  better a       *
+ * possible wait than no progress.                                            */
+#define NODISK_PROBE (1024 * 1024)
+
+static off_t
+nodisk_avail(Ten4_Ctx *ctx)
+{          off_t  start, end;
+          size_t  len, page = (size_t) getpagesize(), n = 0;
+            void *base;
+   unsigned char  vec[NODISK_PROBE / 4096 + 1];
+  if (ctx->cached != NULL || ctx->file_left == 0) return ctx->file_left;
+  if (ctx->resident_to > ctx->file_pos) return ctx->resident_to - ctx->file_pos;
+  start = ctx->file_pos - ctx->file_pos % page;
+  end   = ctx->file_pos + ctx->file_left;
+  len   = (size_t) (end - start < NODISK_PROBE ? end - start : NODISK_PROBE);
+  if (len / page + 1 > sizeof(vec)) len = (sizeof(vec) - 1) * page;
+  if ((base = mmap(NULL, len, PROT_READ, MAP_SHARED, ctx->fd, start))
+      == MAP_FAILED)
+    return ctx->file_left;
+  if (mincore(base, len, (void *) vec) == 0)
+    while (n < (len + page - 1) / page && (vec[n] & 1)) n++;
+  else n = (len + page - 1) / page;  /* Can't tell; assume the best.          */
+  munmap(base, len);
+  ctx->resident_to = start + (off_t) (n * page);
+  if (ctx->resident_to > end) ctx->resident_to = end;
+  if (ctx->resident_to <= ctx->file_pos)
+  { advise_range(ctx->fd, start, (off_t) len);
+    errno = EBUSY;  return -1;
+  }
+  return ctx->resident_to - ctx->file_pos;
+} /* end of nodisk_avail()                                                    */
+
+
+/* cork():                                                                    *
+ * Sets TCP_NOPUSH on {*ctx}'s socket for the rest of the transfer, so that   *
+ * headers, file & trailers go out as full-sized segments rather than a small *
+ * one at each seam.  Does nothing if the socket is not TCP, if the caller    *
+ * has already set the option (theirs to clear, not ours), or if only one     *
+ * write is left to do anyway.                                                */
+static void
+cork(Ten4_Ctx *ctx)
+{ if (ctx->corked != 0) return;
+  ctx->corked = -1;
+#ifdef TEN4_NOPUSH
+  if (ctx->hdr_cnt + ctx->trlr_cnt > 0 || ctx->file_left > (off_t) ctx->chunk)
+  {       int on = 0;
+    socklen_t o_len = sizeof(on);
+    /* Fails (harmlessly) for anything other than TCP.                        */
+    STAT(sys_sockopt, 1);
+    if (getsockopt(ctx->sd, IPPROTO_TCP, TEN4_NOPUSH, &on, &o_len) == 0
+        && on == 0)
+    { on = 1;
+      STAT(sys_sockopt, 1);
+      if (setsockopt(ctx->sd, IPPROTO_TCP, TEN4_NOPUSH, &on, sizeof(on)) == 0)
+        ctx->corked = 1;
+    }
+  }
+#endif
+} /* end of cork()                                                            */
+
+
+/* uncork():                                                                  *
+ * Clears any TCP_NOPUSH that cork() set on {*ctx}'s socket, once the next    *
+ * write (of up to {next} octets) could finish the transfer - so that the     *
+ * last segment goes out at once instead of waiting for more data - &         *
+ * unconditionally if {next} is negative.                                     */
+static void
+uncork(Ten4_Ctx *ctx, off_t next)
+{ if (ctx->corked != 1
+      || (next >= 0 && next < ctx->hdr_len + ctx->file_left + ctx->trlr_len))
+    return;
+#ifdef TEN4_NOPUSH
+  { int off = 0;
+    setsockopt(ctx->sd, IPPROTO_TCP, TEN4_NOPUSH, &off, sizeof(off));
+    STAT(sys_sockopt, 1);
+  }
+#endif
+  ctx->corked = -1;
+} /* end of uncork()                                                          */
+
+
+/* read_chunk():                                                              *
+ * Reads up to {want} octets of file {fd}, starting at offset {pos}, into     *
+ * {buffer}, retrying transient failures up to MAX_RETRIES times.  Returns    *
+ * the number of octets read (zero meaning end-of-file), or -1 with {errno}   *
+ * set to something sendfile() may return.                                    */
+static ssize_t
+read_chunk(int fd, char *buffer, size_t want, off_t pos)
+{  ssize_t got;
+  uint32_t retries = 0;  /* How many times we have retried reading.           */
+  do { got = pread(fd, buffer, want, pos);  STAT(sys_read, 1); }
+  while (got < 0 && (errno == EINTR || errno == EAGAIN)  /* Usually transient.*/
+         && retries++ < MAX_RETRIES);
+  if (got < 0 && errno == EINVAL) errno = EIO;  /* Can't EINVAL here.         */
+  return got;
+} /* end of read_chunk()                                                      */
+
+
+/* The validation cache, for TEN4_OPT_VCACHE:                                 *
+ * What fstat() & getsockopt() last said about each descriptor, so that the   *
+ * repeat calls of a keep-alive connection need not ask again.  An entry, in  *
+ * a table indexed by descriptor number, stands until the caller reports the  *
+ * descriptor closed (or its file changed) via ten4_sendfile_forget().        */
+#define VCACHE_SLOTS 1024
+
+enum { VC_EMPTY = 0, VC_FILE, VC_SOCK };
+
+typedef struct {
+        int  fd;
+        int  kind;     /* VC_FILE (a regular file), VC_SOCK (a stream socket) *
+                        * or VC_EMPTY.                                        */
+      dev_t  dev;      /* The rest are for VC_FILE only:  the file's identity */
+      ino_t  ino;
+      off_t  size;     /* ... & its state, as at the fstat().                 */
+     time_t  mtime;
+  blksize_t  blksize;
+} Ten4_Vc;
+
+static pthread_mutex_t vcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Ten4_Vc         vcache[VCACHE_SLOTS];
+
+/* vc_lookup():                                                               *
+ * Copies the cache entry for descriptor {fd} into {*entry}, if there is one  *
+ * of the right {kind}.  Returns whether there was.                           */
+static int
+vc_lookup(int fd, int kind, Ten4_Vc *entry)
+{ Ten4_Vc *slot  = &vcache[(unsigned) fd % VCACHE_SLOTS];
+      int  found;
+  if (! opt_vcache || fd < 0) return 0;
+  pthread_mutex_lock(&vcache_lock);
+  if ((found = (slot->kind == kind && slot->fd == fd))) *entry = *slot;
+  pthread_mutex_unlock(&vcache_lock);
+  return found;
+} /* end of vc_lookup()                                                       */
+
+/* vc_store():                                                                *
+ * Records {*entry}, displacing whatever shared its slot.                     */
+static void
+vc_store(const Ten4_Vc *entry)
+{ if (! opt_vcache || entry->fd < 0) return;
+  pthread_mutex_lock(&vcache_lock);
+  vcache[(unsigned) entry->fd % VCACHE_SLOTS] = *entry;
+  pthread_mutex_unlock(&vcache_lock);
+} /* end of vc_store()                                                        */
+
+
+/* ten4_sendfile_forget():                                                    *
+ * Drops whatever the validation cache knows about descriptor {fd}, or about  *
+ * every descriptor if {fd} is negative.  Always returns 0.                   */
 int
-sendfile (int  fd,      /* Descriptor for the file to send.                   */
-          int  sd,      /* Descriptor for the socket to send to.              */
-        off_t  offset,  /* {int64_t}.  Index of the first file octet to send. */
-        off_t *len,     /* In:  Number of octets to read from the file.       *
-                         * Out:  Total number of octets written (headers,     *
-                                 file, and trailers combined).                */
-      Sf_HdTr *hdtr,    /* Optional header and/or trailer data.               */
-          int  flags    /* Reserved.  Return an error if nonzero.             */
-         )
-{ const int BUF_SZ     = 8192;  /* Buffer size to suit a disk read.           */
-       Stat stats;              /* For the stat() calls.                      */
-       char buffer[BUF_SZ];     /* The actual buffer.                         */
-      off_t len_2_read,         /* How much data to read from the file.       */
-            infile_ptr,         /* Track the input-file file pointer.         */
-            cumulative = 0;     /* Net number of octets sent.                 */
-    ssize_t buf_ptr    = 0;     /* {long}.  Buffer index (end-of-data + 1).   */
-   uint32_t retries;            /* How many times we have retried sending.    */
-  socklen_t s_len;              /* {uint32_t}.  For the getsockinfo call.     */
-        int result;             /* For subroutine & system calls.             */
-  /* Sanity-check the arguments.                                              */
-  if (len == NULL) { errno = EINVAL;  return -1; }
-  len_2_read = *len;
-  *len = 0;  /* This is the correct value for all the error returns below.    */
-  if (offset < 0 || flags != 0) { errno = EINVAL;  return -1; }
+ten4_sendfile_forget(int fd)
+{ pthread_mutex_lock(&vcache_lock);
+  if (fd < 0) memset(vcache, 0, sizeof(vcache));
+  else if (vcache[(unsigned) fd % VCACHE_SLOTS].fd == fd)
+    vcache[(unsigned) fd % VCACHE_SLOTS].kind = VC_EMPTY;
+  pthread_mutex_unlock(&vcache_lock);
+  return 0;
+} /* end of ten4_sendfile_forget()                                            */
 
-  /* Sanity-check the file descriptor.                                        */
+
+/* The content cache, for TEN4_OPT_CACHE_MAX:                                 *
+ * Whole files' contents, kept in memory to be sent again without reading.    *
+ * It is split into shards by file, each with its own lock, hash table & LRU  *
+ * list (most recently used first) & an even share of the memory allowed, so  *
+ * that threads sending different files seldom contend.  An entry is counted  *
+ * once for being in the cache & once for each transfer sending from it, &    *
+ * is freed when the last of those lets go; so it can be evicted mid-send.    */
+#define CACHE_SHARDS  16
+#define CACHE_BUCKETS 64  /* Hash chains per shard.                           */
+
+struct ten4_centry {
+  struct ten4_centry *hnext;        /* Next in its hash chain.                */
+  struct ten4_centry *prev, *next;  /* Neighbours in its shard's LRU list.    */
+               dev_t  dev;          /* The file's identity ...                */
+               ino_t  ino;
+              time_t  mtime;        /* ... & state, when it was read in.      */
+               off_t  size;
+                 int  shard;
+                 int  refs;         /* Guarded by the shard's lock.           */
+                char *data;         /* The file's contents.                   */
+};
+
+typedef struct {
+  pthread_mutex_t  lock;
+      Ten4_CEntry *bucket[CACHE_BUCKETS];
+      Ten4_CEntry *newest, *oldest;
+           size_t  bytes;            /* Octets of file data held.             */
+} Ten4_Shard;
+
+static Ten4_Shard     shards[CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void
+shards_init(void)
+{ for (int i = 0; i < CACHE_SHARDS; i++)
+    pthread_mutex_init(&shards[i].lock, NULL);
+} /* end of shards_init()                                                     */
+
+static unsigned
+cache_hash(dev_t dev, ino_t ino)
+{ uint64_t h = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) ino;
+  h ^= h >> 29;  h *= 0xBF58476D1CE4E5B9ULL;  h ^= h >> 32;
+  return (unsigned) h;
+} /* end of cache_hash()                                                      */
+
+/* cache_unlink():                                                            *
+ * Takes {*e} out of {*sh}'s table & list, dropping the cache's count of it.  *
+ * Must be called with the shard locked.                                      */
+static void
+cache_unlink(Ten4_Shard *sh, Ten4_CEntry *e)
+{ Ten4_CEntry **link = &sh->bucket[(cache_hash(e->dev, e->ino) / CACHE_SHARDS)
+                                   % CACHE_BUCKETS];
+  while (*link != e) link = &(*link)->hnext;
+  *link = e->hnext;
+  if (e->prev != NULL) e->prev->next = e->next;  else sh->newest = e->next;
+  if (e->next != NULL) e->next->prev = e->prev;  else sh->oldest = e->prev;
+  sh->bytes -= (size_t) e->size;
+  if (--e->refs == 0) { free(e->data);  free(e); }
+} /* end of cache_unlink()                                                    */
+
+/* shard_trim():                                                              *
+ * Evicts from locked shard {*sh} the least recently used entries, until what *
+ * it holds is within {limit} octets.                                         */
+static void
+shard_trim(Ten4_Shard *sh, size_t limit)
+{ while (sh->bytes > limit && sh->oldest != NULL)
+    cache_unlink(sh, sh->oldest);
+} /* end of shard_trim()                                                      */
+
+/* cache_trim():                                                              *
+ * Brings every shard within its share of TEN4_OPT_CACHE_MAX.                 */
+static void
+cache_trim(void)
+{ pthread_once(&shards_once, shards_init);
+  for (int i = 0; i < CACHE_SHARDS; i++)
+  { pthread_mutex_lock(&shards[i].lock);
+    shard_trim(&shards[i], (size_t) (opt_cache_max / CACHE_SHARDS));
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+} /* end of cache_trim()                                                      */
+
+/* cache_get():                                                               *
+ * Returns a counted reference to the cached contents of file {fd}, as        *
+ * described by {*known}, reading them in first if they are not there yet &   *
+ * they fit.  Returns NULL if the file is not (& cannot be) cached; the file  *
+ * is then to be read as usual, so any error in reading it here is ignored.   */
+static Ten4_CEntry *
+cache_get(int fd, const Ten4_Vc *known)
+{    size_t  limit = (size_t) (opt_cache_max / CACHE_SHARDS);
+   unsigned  hash;
+ Ten4_Shard *sh;
+Ten4_CEntry *e, *fresh;
+    ssize_t  got;
+      off_t  have = 0;
+  if (known->size <= 0 || known->size > opt_cache_file
+      || (uint64_t) known->size > limit)
+    return NULL;
+  pthread_once(&shards_once, shards_init);
+  hash = cache_hash(known->dev, known->ino);
+  sh = &shards[hash % CACHE_SHARDS];
+  hash = (hash / CACHE_SHARDS) % CACHE_BUCKETS;
+
+  pthread_mutex_lock(&sh->lock);
+  for (e = sh->bucket[hash]; e != NULL; e = e->hnext)
+    if (e->dev == known->dev && e->ino == known->ino) break;
+  if (e != NULL && (e->mtime != known->mtime || e->size != known->size))
+  { cache_unlink(sh, e);  e = NULL; }  /* The file has changed since.         */
+  if (e != NULL)  /* A hit:  move it to the front, & count this use.          */
+  { if (e->prev != NULL)
+    { e->prev->next = e->next;
+      if (e->next != NULL) e->next->prev = e->prev;  else sh->oldest = e->prev;
+      e->prev = NULL;  e->next = sh->newest;
+      sh->newest->prev = e;  sh->newest = e;
+    }
+    e->refs++;
+  }
+  pthread_mutex_unlock(&sh->lock);
+  if (e != NULL) return e;
+
+  /* A miss:  Read the file in, unlocked, then add it (unless another thread  *
+   * has beaten us to it, in which case theirs is used).                      */
+  if ((fresh = calloc(1, sizeof(Ten4_CEntry))) == NULL) return NULL;
+  if ((fresh->data = malloc((size_t) known->size)) == NULL)
+  { free(fresh);  return NULL; }
+  while (have < known->size
+         && (got = read_chunk(fd, fresh->data + have,
+                              (size_t) (known->size - have), have)) > 0)
+    have += got;
+  if (have != known->size)  /* Failed, or the file shrank meanwhile.          */
+  { free(fresh->data);  free(fresh);  return NULL; }
+  fresh->dev   = known->dev;    fresh->ino  = known->ino;
+  fresh->mtime = known->mtime;  fresh->size = known->size;
+  fresh->shard = (int) (sh - shards);
+  fresh->refs  = 2;  /* The cache's, & the caller's.                          */
+
+  pthread_mutex_lock(&sh->lock);
+  for (e = sh->bucket[hash]; e != NULL; e = e->hnext)
+    if (e->dev == known->dev && e->ino == known->ino) break;
+  if (e != NULL && e->mtime == known->mtime && e->size == known->size)
+  { e->refs++;
+    pthread_mutex_unlock(&sh->lock);
+    free(fresh->data);  free(fresh);
+    return e;
+  }
+  if (e != NULL) cache_unlink(sh, e);
+  shard_trim(sh, limit - (size_t) fresh->size);  /* Make room.                */
+  fresh->hnext = sh->bucket[hash];  sh->bucket[hash] = fresh;
+  if ((fresh->next = sh->newest) != NULL) sh->newest->prev = fresh;
+  else sh->oldest = fresh;
+  sh->newest = fresh;
+  sh->bytes += (size_t) fresh->size;
+  pthread_mutex_unlock(&sh->lock);
+  return fresh;
+} /* end of cache_get()                                                       */
+
+/* cache_put():                                                               *
+ * Lets go of a reference from cache_get().                                   */
+static void
+cache_put(Ten4_CEntry *e)
+{ Ten4_Shard *sh;
+         int  last;
+  if (e == NULL) return;
+  sh = &shards[e->shard];
+  pthread_mutex_lock(&sh->lock);
+  last = (--e->refs == 0);
+  pthread_mutex_unlock(&sh->lock);
+  if (last) { free(e->data);  free(e); }
+} /* end of cache_put()                                                       */
+
+
+/* digest_sent():                                                             *
+ * Hands the {len} file octets at {data}, which have just gone out, to        *
+ * {*ctx}'s digest callback, if it has one.                                   */
+static inline void
+digest_sent(Ten4_Ctx *ctx, const char *data, off_t len)
+{ if (ctx->digest != NULL && len > 0)
+    ctx->digest(ctx->digest_arg, data, (size_t) len);
+} /* end of digest_sent()                                                     */
+
+
+/* account_sent():                                                            *
+ * Records in {*ctx} that the next {done} octets of what it has left to send, *
+ * taking headers, file data & trailers in that order, have now gone out.     */
+static void
+account_sent(Ten4_Ctx *ctx, off_t done)
+{ off_t part;
+  ctx->sent += done;
+  part = (done < ctx->hdr_len ? done : ctx->hdr_len);
+  advance_iovv(&ctx->headers, &ctx->hdr_cnt, &ctx->hdr_skip, (size_t) part);
+  ctx->hdr_len -= part;  done -= part;
+  part = (done < ctx->file_left ? done : ctx->file_left);
+  ctx->file_pos += part;  ctx->file_left -= part;  done -= part;
+  advance_iovv(&ctx->trailers, &ctx->trlr_cnt, &ctx->trlr_skip, (size_t) done);
+  ctx->trlr_len -= done;
+} /* end of account_sent()                                                    */
+
+
+/* The gathering copy, for TEN4_OPT_GATHER_MIN:                               *
+ * Past some number of pieces, writev() spends longer walking the {IOVec}     *
+ * array & wiring down each piece than it would take to copy them all into    *
+ * one buffer first.  The copy is done by whichever of the routines below     *
+ * suits the processor, as chosen once by pick_gather(); each copies {len}    *
+ * octets from {from} to {to}, which must not overlap, & returns {to + len}.  */
+typedef char *(*Ten4_Copy)(char *, const char *, size_t);
+
+/* copy_small():                                                              *
+ * Copies fewer than 16 octets, in at most two moves of a size the compiler   *
+ * can do inline; the moves overlap rather than loop over the odd octets.     */
+static inline char *
+copy_small(char *to, const char *from, size_t len)
+{ if (len >= 8)
+  { memcpy(to, from, 8);  memcpy(to + len - 8, from + len - 8, 8); }
+  else if (len >= 4)
+  { memcpy(to, from, 4);  memcpy(to + len - 4, from + len - 4, 4); }
+  else
+    for (size_t i = 0; i < len; i++) to[i] = from[i];
+  return to + len;
+} /* end of copy_small()                                                      */
+
+/* copy_scalar():                                                             *
+ * For processors without a vector unit we know how to use.                   */
+static char *
+copy_scalar(char *to, const char *from, size_t len)
+{ if (len < 16) return copy_small(to, from, len);
+  memcpy(to, from, len);
+  return to + len;
+} /* end of copy_scalar()                                                     */
+
+#if defined(__SSE2__)
+/* copy_sse2():                                                               *
+ * Moves 16 octets at a time with unaligned loads & stores, which cost next   *
+ * to nothing extra on anything that ever shipped in a Mac.  The last move    *
+ * ends flush with the piece, overlapping the one before it if need be.       */
+static char *
+copy_sse2(char *to, const char *from, size_t len)
+{ char *end = to + len;
+  if (len < 16) return copy_small(to, from, len);
+  for ( ; len > 16; to += 16, from += 16, len -= 16)
+    _mm_storeu_si128((__m128i *) to, _mm_loadu_si128((const __m128i *) from));
+  _mm_storeu_si128((__m128i *) (end - 16),
+                   _mm_loadu_si128((const __m128i *) (from + len - 16)));
+  return end;
+} /* end of copy_sse2()                                                       */
+#endif
+
+#if defined(__ALTIVEC__)
+/* copy_altivec():                                                            *
+ * AltiVec can only load & store aligned quadwords.  So, once the odd octets  *
+ * at the front have brought {to} into line, each quadword stored is picked   *
+ * out of the two aligned ones spanning its source, by the permutation that   *
+ * vec_lvsl() gives for the source's misalignment (which stays the same all   *
+ * the way along).  Both loads fall within the 16 source octets wanted, so    *
+ * neither can stray onto an unmapped page.  Anything under 32 octets is not  *
+ * worth the setting up.                                                      */
+static char *
+copy_altivec(char *to, const char *from, size_t len)
+{                  char *end = to + len;
+                 size_t  head;
+  vector unsigned char   perm;
+  if (len < 16) return copy_small(to, from, len);
+  if (len < 32) { memcpy(to, from, len);  return end; }
+  head = (size_t) (-(uintptr_t) to & 15);
+  memcpy(to, from, head);
+  to += head;  from += head;  len -= head;
+  perm = vec_lvsl(0, (const unsigned char *) from);
+  for ( ; len >= 16; to += 16, from += 16, len -= 16)
+    vec_st(vec_perm(vec_ld(0, (const unsigned char *) from),
+                    vec_ld(15, (const unsigned char *) from), perm),
+           0, (unsigned char *) to);
+  memcpy(to, from, len);
+  return end;
+} /* end of copy_altivec()                                                    */
+#endif
+
+static Ten4_Copy gather_copy = copy_scalar;
+
+/* pick_gather():                                                             *
+ * Chooses the copying routine for this processor, once, from load_config().  */
+static void
+pick_gather(void)
+{
+#if defined(__ALTIVEC__) && defined(__APPLE__)
+     int mib[2] = { CTL_HW, HW_VECTORUNIT },
+         vector = 0;
+  size_t size   = sizeof(vector);
+  if (sysctl(mib, 2, &vector, &size, NULL, 0) == 0 && vector != 0)
+    gather_copy = copy_altivec;
+#elif defined(__SSE2__)
+  gather_copy = copy_sse2;
+#endif
+} /* end of pick_gather()                                                     */
+
+/* gather_iovv():                                                             *
+ * Copies the {n_el} pieces of {iovv}, all but the first {skip} octets of     *
+ * them, end to end into {to}.  Returns the end of what it copied.            */
+static char *
+gather_iovv(char *to, const IOVec *iovv, int n_el, size_t skip)
+{ for (int i = 0; i < n_el; i++, skip = 0)
+    to = gather_copy(to, (const char *) iovv[i].iov_base + skip,
+                     iovv[i].iov_len - skip);
+  return to;
+} /* end of gather_iovv()                                                     */
+
+
+/* send_coalesced():                                                          *
+ * Sends all that {*ctx} has left - headers, file data, and trailers - as one *
+ * {IOVec} array, and so with a single writev() unless the socket fills up.   *
+ * The file data is first read into the context's buffer, which must be big   *
+ * enough for it, unless it is cached.  If {gather}, the headers & trailers   *
+ * are copied in around it, so that the array has at most three members; the  *
+ * buffer must then be big enough for them too.  Progress is recorded just as *
+ * the separate phases would do, so a transfer interrupted here resumes       *
+ * normally.  Returns as a step does.                                         */
+static int
+send_coalesced(Ten4_Ctx *ctx, int gather, int64_t *budget)
+{    char *buffer = ctx->buf,
+          *hdr_end,   /* Where gathered headers end, &                        */
+          *trlr_end;  /*   gathered trailers.                                 */
+    IOVec  iovv[COALESCE_IOVS + 1],
+          *next = iovv;
+      int  n_el = 0,
+           result;
+   size_t  skip = 0;
+  ssize_t  got  = 0;
+    off_t  done = 0;
+  ctx->buf_len = 0;  /* Whatever the buffered loop left in it is overwritten. */
+  if (gather)
+    buffer = hdr_end = gather_iovv(ctx->buf, ctx->headers, ctx->hdr_cnt,
+                                   ctx->hdr_skip);
+  if (ctx->cached != NULL)  /* Nothing to read; it's all in memory.           */
+  { buffer = ctx->cached->data + ctx->file_pos;  got = ctx->file_left; }
+  else if (ctx->file_left > 0)
+  { if ((got = read_chunk(ctx->fd, buffer, (size_t) ctx->file_left,
+                          ctx->file_pos)) < 0)
+      return -1;
+    ctx->file_left = got;  /* In case end-of-file came early.                 */
+  }
+  if (gather && ctx->cached == NULL)  /* It is all one run of the buffer.     */
+  { trlr_end = gather_iovv(buffer + got, ctx->trailers, ctx->trlr_cnt,
+                           ctx->trlr_skip);
+    iovv[0].iov_base = ctx->buf;  iovv[0].iov_len = trlr_end - ctx->buf;
+    n_el = 1;
+  }
+  else if (gather)
+  { trlr_end = gather_iovv(hdr_end, ctx->trailers, ctx->trlr_cnt,
+                           ctx->trlr_skip);
+    iovv[0].iov_base = ctx->buf;  iovv[0].iov_len = hdr_end - ctx->buf;
+    iovv[1].iov_base = buffer;    iovv[1].iov_len = got;
+    iovv[2].iov_base = hdr_end;   iovv[2].iov_len = trlr_end - hdr_end;
+    n_el = 3;
+  }
+  else
+  { if (ctx->hdr_cnt > 0)
+    { memcpy(iovv, ctx->headers, ctx->hdr_cnt * sizeof(IOVec));
+      iovv[0].iov_base = (char *) iovv[0].iov_base + ctx->hdr_skip;
+      iovv[0].iov_len -= ctx->hdr_skip;
+      n_el = ctx->hdr_cnt;
+    }
+    if (got > 0)
+    { iovv[n_el].iov_base = buffer;  iovv[n_el].iov_len = got;  n_el++; }
+    if (ctx->trlr_cnt > 0)
+    { memcpy(&iovv[n_el], ctx->trailers, ctx->trlr_cnt * sizeof(IOVec));
+      iovv[n_el].iov_base = (char *) iovv[n_el].iov_base + ctx->trlr_skip;
+      iovv[n_el].iov_len -= ctx->trlr_skip;
+      n_el += ctx->trlr_cnt;
+    }
+  }
+  result = spool_iovv(ctx->sd, &next, &n_el, &skip, &done, budget);
+  { int saved = errno;  /* Keep spool_iovv()'s errno across the accounting.   */
+    off_t body = done - ctx->hdr_len;  /* File octets among them.             */
+    digest_sent(ctx, buffer, (body < 0 ? 0 : body < got ? body : got));
+    account_sent(ctx, done);
+    errno = saved;
+  }
+  return result;
+} /* end of send_coalesced()                                                  */
+
+
+/* The read-ahead pipeline, for TEN4_SF_PIPELINE:                             *
+ * A helper thread reads the file into one of two pooled buffers while the    *
+ * calling thread sends from the other, so that neither the disk nor the      *
+ * network sits idle while the other is busy.  The buffers are filled & sent  *
+ * strictly in turn; {head} is the one the sender wants next, & {tail} the    *
+ * one the reader fills next.                                                 */
+struct ten4_pipe {
+        pthread_t  thread;    /* The reader.                                  */
+  pthread_mutex_t  lock;      /* Guards everything below.                     */
+   pthread_cond_t  cond;      /* Signalled whenever a buffer changes hands.   */
+              int  fd;        /* The file being read.                         */
+           size_t  chunk;     /* How much to read into each buffer.           */
+            off_t  next_pos;  /* Offset the reader will read from next.       */
+            off_t  end;       /* Offset at which the reader stops.            */
+              int  head,
+                   tail;
+              int  quit;      /* Set when the reader should stop early.       */
+  struct {
+    Ten4_Buf  buf;
+       off_t  pos;            /* File offset of the buffer's first octet.     */
+     ssize_t  len;            /* Octets read into it (0 meaning end-of-file). */
+         int  err;            /* {errno} if the read failed, else 0.          */
+         int  full;           /* Whether the reader has filled it.            */
+  } slot[2];
+};
+
+/* pipe_reader():                                                             *
+ * The helper thread's body.  It fills whichever buffer is next in turn once  *
+ * the sender has emptied it, until the range is read, a read fails, or it is *
+ * told to quit.                                                              */
+static void *
+pipe_reader(void *arg)
+{ Ten4_Pipe *pipe = arg;
+        int  i;
+      off_t  pos;
+     size_t  want;
+    ssize_t  got;
+  pthread_mutex_lock(&pipe->lock);
+  for (;;)
+  { while (! pipe->quit && pipe->next_pos < pipe->end
+           && pipe->slot[pipe->tail].full)
+      pthread_cond_wait(&pipe->cond, &pipe->lock);
+    if (pipe->quit || pipe->next_pos >= pipe->end) break;
+    i = pipe->tail;  pos = pipe->next_pos;
+    want = (pipe->end - pos < (off_t) pipe->chunk
+            ? (size_t) (pipe->end - pos) : pipe->chunk);
+    pthread_mutex_unlock(&pipe->lock);  /* Don't hold it across the disk I/O. */
+    got = read_chunk(pipe->fd, pipe->slot[i].buf.base, want, pos);
+    pthread_mutex_lock(&pipe->lock);
+    pipe->slot[i].pos  = pos;
+    pipe->slot[i].len  = (got > 0 ? got : 0);
+    pipe->slot[i].err  = (got < 0 ? errno : 0);
+    pipe->slot[i].full = 1;
+    pipe->tail ^= 1;
+    /* Stop at end-of-file or on error; the sender will find out from this.   */
+    pipe->next_pos = (got > 0 ? pos + got : pipe->end);
+    pthread_cond_broadcast(&pipe->cond);
+  }
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
+} /* end of pipe_reader()                                                     */
+
+
+/* pipe_stop():                                                               *
+ * Tells {*ctx}'s reader to quit, waits for it to do so, then releases all    *
+ * the pipeline's resources.  Safe to call when there is no pipeline.         */
+static void
+pipe_stop(Ten4_Ctx *ctx)
+{ Ten4_Pipe *pipe = ctx->pipe;
+  if (pipe == NULL) return;
+  pthread_mutex_lock(&pipe->lock);
+  pipe->quit = 1;
+  pthread_cond_broadcast(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+  pthread_join(pipe->thread, NULL);
+  pthread_cond_destroy(&pipe->cond);
+  pthread_mutex_destroy(&pipe->lock);
+  for (int i = 0; i < 2; i++)
+    pool_put(pipe->slot[i].buf.base, pipe->slot[i].buf.size);
+  free(pipe);
+  ctx->pipe = NULL;
+} /* end of pipe_stop()                                                       */
+
+
+/* pipe_start():                                                              *
+ * Sets up the pipeline for what remains of {*ctx}'s file data, & starts its  *
+ * reader.  Returns 0, or -1 if that was not possible, in which case nothing  *
+ * has changed & the transfer can carry on serially.                          */
+static int
+pipe_start(Ten4_Ctx *ctx)
+{ Ten4_Pipe *pipe = calloc(1, sizeof(Ten4_Pipe));
+        int  i;
+  if (pipe == NULL) return -1;
+  pipe->fd = ctx->fd;  pipe->chunk = ctx->chunk;
+  pipe->next_pos = ctx->file_pos;  pipe->end = ctx->file_pos + ctx->file_left;
+  for (i = 0; i < 2; i++)
+  { pipe->slot[i].buf.size = ctx->chunk;
+    if ((pipe->slot[i].buf.base = pool_get(&pipe->slot[i].buf.size)) == NULL)
+      break;
+  }
+  if (i == 2 && pthread_mutex_init(&pipe->lock, NULL) == 0)
+  { if (pthread_cond_init(&pipe->cond, NULL) == 0)
+    { if (pthread_create(&pipe->thread, NULL, pipe_reader, pipe) == 0)
+      { ctx->pipe = pipe;  return 0; }
+      pthread_cond_destroy(&pipe->cond);
+    }
+    pthread_mutex_destroy(&pipe->lock);
+  }
+  for (i = 0; i < 2; i++)
+    pool_put(pipe->slot[i].buf.base, pipe->slot[i].buf.size);
+  free(pipe);
+  return -1;
+} /* end of pipe_start()                                                      */
+
+
+/* pipe_next():                                                               *
+ * Waits until the buffer holding file offset {pos} has been read, then sets  *
+ * {*data} to point at that octet.  Returns how many octets from there on the *
+ * buffer holds (zero at end-of-file), or -1 with {errno} set if the read     *
+ * failed.                                                                    */
+static ssize_t
+pipe_next(Ten4_Pipe *pipe, off_t pos, char **data)
+{ ssize_t avail = -1;
+  pthread_mutex_lock(&pipe->lock);
+  while (! pipe->slot[pipe->head].full)
+    pthread_cond_wait(&pipe->cond, &pipe->lock);
+  { int i = pipe->head;
+    if (pipe->slot[i].err) errno = pipe->slot[i].err;
+    else
+    { *data = (char *) pipe->slot[i].buf.base + (pos - pipe->slot[i].pos);
+      avail = pipe->slot[i].pos + pipe->slot[i].len - pos;
+    }
+  }
+  pthread_mutex_unlock(&pipe->lock);
+  return avail;
+} /* end of pipe_next()                                                       */
+
+
+/* pipe_done():                                                               *
+ * Hands the head buffer back to the reader for refilling, once everything    *
+ * in it (i.e., everything before file offset {pos}) has been sent.           */
+static void
+pipe_done(Ten4_Pipe *pipe, off_t pos)
+{ pthread_mutex_lock(&pipe->lock);
+  { int i = pipe->head;
+    if (pos >= pipe->slot[i].pos + pipe->slot[i].len)
+    { pipe->slot[i].full = 0;
+      pipe->head ^= 1;
+      pthread_cond_broadcast(&pipe->cond);
+    }
+  }
+  pthread_mutex_unlock(&pipe->lock);
+} /* end of pipe_done()                                                       */
+
+
+/* check_file():                                                              *
+ * Makes sure that {fd} is a regular file, filling in {*known} with what the  *
+ * validation cache (or else fstat()) says of it.  Returns 0 if so, or -1     *
+ * with {errno} set as sendfile() should report it.                           */
+static int
+check_file(int fd, Ten4_Vc *known)
+{ Stat stats;
+  if (vc_lookup(fd, VC_FILE, known)) return 0;
+  STAT(sys_fstat, 1);
   if (fstat(fd, &stats)) return -1;  /* All 3 possible errnos are OK.         */
   if ((stats.st_mode & S_IFMT) != S_IFREG)  /* Not a regular file.  Fail.     */
   { errno = ENOTSUP; return -1; }
-  if (offset > stats.st_size) len_2_read = 0;  /* So we can check {sd} too.   */
+  known->fd   = fd;              known->kind  = VC_FILE;
+  known->dev  = stats.st_dev;    known->ino   = stats.st_ino;
+  known->size = stats.st_size;   known->mtime = stats.st_mtime;
+  known->blksize = stats.st_blksize;
+  vc_store(known);
+  return 0;
+} /* end of check_file()                                                      */
 
-  /* Sanity-check the socket descriptor, insofar as is practical.             */
+
+/* check_socket():                                                            *
+ * Makes sure, insofar as is practical, that {sd} is a stream socket.         *
+ * Returns 0 if so, or -1 with {errno} set as sendfile() should report it.    */
+static int
+check_socket(int sd)
+{      Stat stats;
+    Ten4_Vc known;
+  socklen_t s_len;              /* {uint32_t}.  For the getsockinfo call.     */
+        int type;
+  if (vc_lookup(sd, VC_SOCK, &known)) return 0;
+  STAT(sys_fstat, 1);
   if (fstat(sd, &stats)) return -1;  /* All 3 possible errnos are OK.         */
   if ((stats.st_mode & S_IFMT) != S_IFSOCK)  /* Not a socket.  Fail.          */
   { errno = ENOTSOCK;  return -1; }
-  s_len = sizeof(result);
-  if (getsockopt(sd, SOL_SOCKET, SO_TYPE, &result, &s_len)) /* Got an error.  */
+  s_len = sizeof(type);
+  STAT(sys_sockopt, 1);
+  if (getsockopt(sd, SOL_SOCKET, SO_TYPE, &type, &s_len)) /* Got an error.    */
   { /* All possible errors are OK as is, except these two:                    */
     if ((errno == EDOM) || (errno == ENOPROTOOPT)) { errno = EINVAL; }
     return -1;
   }
-  if (result != SOCK_STREAM) { errno = ENOTSOCK;  return -1; }
+  if (type != SOCK_STREAM) { errno = ENOTSOCK;  return -1; }
+  known.fd = sd;  known.kind = VC_SOCK;
+  vc_store(&known);
+  return 0;
+} /* end of check_socket()                                                    */
 
-  /* Seek file to correct pos'n.  Do this now so can die early if it fails.   */
-  infile_ptr = lseek(fd, offset, SEEK_SET);
-  /* If this errored, infile_ptr (= -1) will never equal offset (>= 0).  Even
-     if it thinks it succeeded, if the two differ we still want to bail out.  */
-  if (infile_ptr != offset) { errno = EIO;  return -1; }
+
+/* setup():                                                                   *
+ * Does the work of ten4_sendfile_init(), q.v., except that {sd} is taken as  *
+ * already checked unless {check_sd} is true.                                 */
+static int
+setup(Ten4_Ctx *ctx, int fd, int sd, off_t offset, off_t len, Sf_HdTr *hdtr,
+      int flags, int check_sd)
+{   Ten4_Vc known;              /* What the validation cache knows of {fd}.   */
+        int result;             /* For subroutine & system calls.             */
+  /* Sanity-check the arguments.                                              */
+  pthread_once(&config_once, load_config);
+  if (ctx == NULL) { errno = EFAULT;  return -1; }
+  ctx->fd = fd;  ctx->sd = sd;  ctx->sent = 0;
+  ctx->headers = ctx->trailers = NULL;  ctx->hdr_cnt = ctx->trlr_cnt = 0;
+  ctx->hdr_len = ctx->trlr_len = 0;  ctx->hdr_skip = ctx->trlr_skip = 0;
+  ctx->file_pos = offset;  ctx->file_left = 0;
+  ctx->nonblocking = 0;  ctx->flags = flags | (int) opt_flags;
+  ctx->advised = 0;  ctx->nocache = 0;  ctx->corked = 0;
+  ctx->sndbuf = 0;  ctx->sndlowat = -1;
+  ctx->map_base = NULL;  ctx->map_off = 0;  ctx->map_len = 0;
+  ctx->buf = NULL;  ctx->buf_sz = 0;  ctx->chunk = 0;  ctx->pipe = NULL;
+  ctx->buf_pos = 0;  ctx->buf_len = 0;
+  ctx->loop = NULL;  ctx->done = NULL;  ctx->done_arg = NULL;
+  ctx->digest = NULL;  ctx->digest_arg = NULL;
+  ctx->paced = 0;  ctx->pace_rate = 0;  ctx->pace_tokens = 0;
+  ctx->pace_stamp = 0;  ctx->pace_due = 0;
+  ctx->prev = ctx->next = NULL;  ctx->cached = NULL;  ctx->resident_to = 0;
+  if (offset < 0 || len < 0 || (flags & ~TEN4_SF_ALL) != 0)
+  { errno = EINVAL;  return -1; }
+  /* The read-ahead pipeline is a thread blocking on the disk on our behalf,  *
+   * which is the very thing that TEN4_SF_NODISKIO is there to prevent.       */
+  if (ctx->flags & TEN4_SF_NODISKIO) ctx->flags &= ~TEN4_SF_PIPELINE;
+
+  /* Sanity-check the file descriptor.                                        */
+  if (check_file(fd, &known)) return -1;  /* errno OK.                        */
+  /* Work out exactly how much file there is to send.  An {offset} past the   *
+   * end means sending nothing at all - not even headers or trailers - but we *
+   * still check {sd}, as the caller would be owed an error if it were bad.   */
+  if (offset <= known.size)
+  { ctx->file_left = known.size - offset;
+    if (len != 0 && len < ctx->file_left) ctx->file_left = len;
+    if (hdtr && (hdtr->headers != NULL || hdtr->hdr_cnt != 0))
+    { if ((ctx->hdr_len = check_iovv(hdtr->headers, hdtr->hdr_cnt)) < 0)
+        return -1;  /* check_iovv() already set {errno} to suit.              */
+      ctx->headers = hdtr->headers;    ctx->hdr_cnt  = hdtr->hdr_cnt;
+    }
+    if (hdtr && (hdtr->trailers != NULL || hdtr->trlr_cnt != 0))
+    { if ((ctx->trlr_len = check_iovv(hdtr->trailers, hdtr->trlr_cnt)) < 0)
+        return -1;  /* check_iovv() already set {errno} to suit.              */
+      ctx->trailers = hdtr->trailers;  ctx->trlr_cnt = hdtr->trlr_cnt;
+    }
+  }
+
+  /* Sanity-check the socket descriptor, insofar as is practical.             */
+  if (check_sd && check_socket(sd)) return -1;  /* errno OK.                  */
+  /* A socket marked for nonblocking I/O gets no waiting at all:  the first   *
+   * EAGAIN goes straight back to the caller, with {*len} saying exactly how  *
+   * far the transfer got, so that they can resume once {sd} drains.          */
+  STAT(sys_fcntl, 1);
+  if ((result = fcntl(sd, F_GETFL)) == -1) return -1;  /* EBADF is OK.        */
+  ctx->nonblocking = ((result & O_NONBLOCK) != 0);
+  /* A large transfer can be given a send buffer to suit, if so asked, & its  *
+   * chunks sized to fill it.                                                 */
+  result = 0;
+  if ((ctx->flags & TEN4_SF_SNDBUF) && ctx->file_left >= opt_sndbuf_min
+      && ctx->hdr_len + ctx->file_left + ctx->trlr_len > opt_coalesce)
+    result = tune_sndbuf(ctx);
+  ctx->chunk = choose_chunk(ctx, known.blksize, result);
+  if (result > 0) tune_lowat(ctx, result);
+  ctx->paced = (opt_pace_rate > 0
+                && ctx->hdr_len + ctx->file_left + ctx->trlr_len
+                   > opt_pace_burst);
+  if (opt_cache_max > 0 && ctx->file_left > 0)
+    ctx->cached = cache_get(fd, &known);
+
+  /* A transfer big enough to flush everyone else's data out of the buffer    *
+   * cache can be kept out of it, if so asked.  (This can't be queried first, *
+   * so ten4_sendfile_finish() simply turns it off again.)                    */
+#ifdef F_NOCACHE
+  if ((ctx->flags & TEN4_SF_NOCACHE) && ctx->file_left >= opt_nocache_min)
+  { ctx->nocache = (fcntl(fd, F_NOCACHE, 1) != -1);
+    STAT(sys_fcntl, 1);
+  }
+#endif
+  return 0;
+} /* end of setup()                                                           */
+
+
+/* ten4_sendfile_init():                                                      *
+ * Sets up {*ctx} for a transfer, validating everything that sendfile() does  *
+ * & failing in the same ways (with nothing yet sent).  Returns 0 on success, *
+ * or -1 with {errno} set appropriately.                                      */
+int
+ten4_sendfile_init(Ten4_Ctx *ctx,     /* The context to set up.               */
+                        int  fd,      /* As for sendfile().                   */
+                        int  sd,      /* As for sendfile().                   */
+                      off_t  offset,  /* As for sendfile().                   */
+                      off_t  len,     /* Number of file octets to send (if 0, *
+                                       * all of them through end-of-file).    */
+                    Sf_HdTr *hdtr,    /* As for sendfile().                   */
+                        int  flags    /* As for sendfile().                   */
+                  )
+{ return setup(ctx, fd, sd, offset, len, hdtr, flags, 1);
+} /* end of ten4_sendfile_init()                                              */
+
+
+/* step_transfer():                                                           *
+ * Does the work of ten4_sendfile_step(), which see, short of uncorking the   *
+ * socket after an error.                                                     */
+static int
+step_transfer(Ten4_Ctx *ctx)
+{   ssize_t buf_ptr    = 0;     /* {long}.  Buffer index (end-of-data + 1).   */
+      off_t avail;              /* File octets in memory, for NODISKIO.       */
+      off_t temp_len;           /* Octets moved by spool_iovv().              */
+        int result;             /* For subroutine & system calls.             */
+    int64_t budget = (ctx->nonblocking ? 0 : opt_timeout_ms < 0 ? -1
+                      : opt_timeout_ms * 1000);
+                                /* Microseconds we may yet wait on {sd}.      */
+        int gather = (opt_gather_min > 0
+                      && ctx->hdr_cnt + ctx->trlr_cnt >= opt_gather_min);
+                                /* Whether to copy the pieces together.       */
+  ctx->pace_due = 0;
+  /* A small response goes out in one writev(), rather than one syscall (and  *
+   * likely one packet) each for the headers, the file, & the trailers.  With *
+   * enough pieces, they are gathered into the buffer beforehand.  Under      *
+   * NODISKIO, a cold file is refused before any of it is sent, so that the   *
+   * caller's retry does not find half its headers already on the wire.  A    *
+   * paced transfer is never coalesced, as it must pay for its file data.     */
+  if (ctx->hdr_cnt + ctx->trlr_cnt > 0 && ! ctx->paced
+      && (ctx->hdr_cnt + ctx->trlr_cnt <= COALESCE_IOVS || gather)
+      && ctx->file_left <= (off_t) ctx->chunk
+      && ctx->hdr_len + ctx->file_left + ctx->trlr_len <= opt_coalesce)
+  { avail = ctx->file_left;
+    if ((ctx->flags & TEN4_SF_NODISKIO) && (avail = nodisk_avail(ctx)) < 0)
+      return -1;  /* EBUSY.                                                   */
+    if (avail >= ctx->file_left)
+    { off_t want = (ctx->cached == NULL ? ctx->file_left : 0)
+                   + (gather ? ctx->hdr_len + ctx->trlr_len : 0);
+      trace_phase(TEN4_PH_BODY);
+      return (want > 0 && ensure_buffer(ctx, (size_t) want)
+              ? -1 : send_coalesced(ctx, gather, &budget));
+    }
+  }
+  cork(ctx);
 
   /* Spool any headers to the socket:                                         */
-  if (hdtr && (hdtr->headers != NULL || hdtr->hdr_cnt != 0))
-  { IOVec *temp_iovv = hdtr->headers;
-      int  temp_n    = hdtr->hdr_cnt;
-    off_t  temp_len  = 0;
-    if (spool_iovv(sd, &temp_iovv, &temp_n, &temp_len)) return -1; /* errno OK*/
-    *len += temp_len;
-  }
-
-  /* Spool the file via the buffer to the socket:                             */
-  retries = 0;
-  while (len_2_read > 0)
-  { buf_ptr = read(fd, &buffer, (BUF_SZ < len_2_read ? BUF_SZ : len_2_read));
-    if (buf_ptr < 0)  /* The read call failed.                                */
-    { if (errno == EINTR || errno == EAGAIN)  /* Usually transient.           */
-      { if (retries++ < MAX_RETRIES) continue;  /* Try again.                 */
-        else { *len += cumulative;  return -1; }  /* Give up.                 */
-      }
-      else  /* It actually is a failure we can't ignore.                      */
-      { if (errno == EINVAL) errno = EIO;  /* Can't EINVAL here.              */
-        *len += cumulative;  return -1;
-    } }  /* If we've gotten this far, it didn't error out on us!  Yay!        */
-    if (buf_ptr == 0) break;  /* We've hit EOF.                               */
-    /* buf_ptr > 0:  Got data to send.                                        */
-    len_2_read -= buf_ptr;  /* Got this much left to go.                      */
-    result = stubborn_send(buffer, &buf_ptr, sd);
-    if (result == -1) { *len += cumulative;  return -1; }  /* All errors OK.  */
-    cumulative += buf_ptr;
-  }
-  *len += cumulative;
+  if (ctx->hdr_cnt > 0)
+  { uncork(ctx, ctx->hdr_len);
+    result = spool_iovv(ctx->sd, &ctx->headers, &ctx->hdr_cnt,
+                        &ctx->hdr_skip, &temp_len, &budget);
+    ctx->sent    += temp_len;  /* Count whatever got sent, even if not all.   */
+    ctx->hdr_len -= temp_len;
+    if (result) return -1;  /* errno OK.                                      */
+    ctx->hdr_cnt = 0;
+  }
+
+  trace_phase(TEN4_PH_BODY);
+
+  /* Spool the file straight from the content cache, if it is there.          */
+  while (ctx->file_left > 0 && ctx->cached != NULL)
+  { avail = ((off_t) ctx->chunk < ctx->file_left
+             ? (off_t) ctx->chunk : ctx->file_left);
+    if (pace(ctx, &avail)) return -1;  /* EAGAIN or EINTR.                    */
+    buf_ptr = (ssize_t) avail;
+    uncork(ctx, buf_ptr);
+    result = stubborn_send(ctx->cached->data + ctx->file_pos, &buf_ptr,
+                           ctx->sd, &budget);
+    /* On error, buf_ptr holds the part that went.                            */
+    STAT(bytes_cached, buf_ptr);
+    digest_sent(ctx, ctx->cached->data + ctx->file_pos, buf_ptr);
+    pace_charge(ctx, buf_ptr);
+    ctx->sent      += buf_ptr;
+    ctx->file_pos  += buf_ptr;
+    ctx->file_left -= buf_ptr;
+    if (result == -1) return -1;  /* All errors OK.                           */
+  }
+
+  /* Spool the file straight from a mapping of it, if so asked.  Should that  *
+   * not be possible, fall back to reading it instead.                        */
+  while (ctx->file_left > 0 && (ctx->flags & TEN4_SF_MMAP))
+  { if (ctx->map_base == NULL
+        || ctx->file_pos >= ctx->map_off + (off_t) ctx->map_len)
+    { advise_ahead(ctx);
+      if (map_window(ctx)) { ctx->flags &= ~TEN4_SF_MMAP;  break; }
+    }
+    /* The window never extends past the end of what is to be sent.           */
+    buf_ptr = ctx->map_off + ctx->map_len - ctx->file_pos;
+    if ((ctx->flags & TEN4_SF_NODISKIO)
+        && (avail = nodisk_avail(ctx)) < (off_t) buf_ptr)
+    { if (avail < 0) return -1;  /* EBUSY.                                    */
+      buf_ptr = (ssize_t) avail;
+    }
+    avail = buf_ptr;
+    if (pace(ctx, &avail)) return -1;  /* EAGAIN or EINTR.                    */
+    buf_ptr = (ssize_t) avail;
+    uncork(ctx, buf_ptr);
+    result = stubborn_send(ctx->map_base + (ctx->file_pos - ctx->map_off),
+                           &buf_ptr, ctx->sd, &budget);
+    /* On error, buf_ptr holds the part that went.                            */
+    STAT(bytes_mapped, buf_ptr);
+    digest_sent(ctx, ctx->map_base + (ctx->file_pos - ctx->map_off), buf_ptr);
+    pace_charge(ctx, buf_ptr);
+    ctx->sent      += buf_ptr;
+    ctx->file_pos  += buf_ptr;
+    ctx->file_left -= buf_ptr;
+    if (result == -1) return -1;  /* All errors OK.                           */
+  }
+  unmap_window(ctx);  /* Be it all sent, or abandoned in favour of reading.   */
+
+  /* Spool the file via the read-ahead pipeline, if so asked.  If that cannot *
+   * be set up, fall back to the plain buffered loop below.  Progress & error *
+   * reports are exactly as they are there.  What fits in one chunk has no    *
+   * read to overlap with a send, so it takes the buffered loop, too, rather  *
+   * than pay for starting (& joining) a reader thread.                       */
+  if (ctx->file_left > (off_t) ctx->chunk && (ctx->flags & TEN4_SF_PIPELINE)
+      && ctx->pipe == NULL && pipe_start(ctx))
+    ctx->flags &= ~TEN4_SF_PIPELINE;
+  while (ctx->file_left > 0 && ctx->pipe != NULL)
+  { char *data;
+    advise_ahead(ctx);
+    if ((buf_ptr = pipe_next(ctx->pipe, ctx->file_pos, &data)) < 0)
+      return -1;  /* The reader already set {errno} to suit.                  */
+    if (buf_ptr == 0) { ctx->file_left = 0;  break; }  /* We've hit EOF.      */
+    avail = buf_ptr;
+    if (pace(ctx, &avail)) return -1;  /* EAGAIN or EINTR.                    */
+    buf_ptr = (ssize_t) avail;
+    uncork(ctx, buf_ptr);
+    result = stubborn_send(data, &buf_ptr, ctx->sd, &budget);
+    /* On error, buf_ptr holds the part that went.                            */
+    STAT(bytes_piped, buf_ptr);
+    digest_sent(ctx, data, buf_ptr);
+    pace_charge(ctx, buf_ptr);
+    ctx->sent      += buf_ptr;
+    ctx->file_pos  += buf_ptr;
+    ctx->file_left -= buf_ptr;
+    pipe_done(ctx->pipe, ctx->file_pos);
+    if (result == -1) return -1;  /* All errors OK.                           */
+  }
+  pipe_stop(ctx);
+
+  /* Spool the file via the buffer to the socket.  Reading with pread() never *
+   * touches {fd}'s file pointer, so any number of threads can send from the  *
+   * same descriptor at once, & a partial send needs no seeking back.  What a *
+   * partial send leaves of a chunk stays in the buffer, to be sent from      *
+   * there by the next step; only once it is used up is the next one read.    */
+  if (ctx->file_left > 0 && ensure_buffer(ctx, ctx->chunk)) return -1;
+  while (ctx->file_left > 0)
+  { char *data;
+    off_t in_buf = ctx->buf_pos + (off_t) ctx->buf_len - ctx->file_pos;
+    if (ctx->file_pos < ctx->buf_pos || in_buf <= 0)
+    { avail = ((off_t) ctx->chunk < ctx->file_left
+               ? (off_t) ctx->chunk : ctx->file_left);
+      advise_ahead(ctx);
+      if ((ctx->flags & TEN4_SF_NODISKIO)
+          && (avail = nodisk_avail(ctx)) > (off_t) ctx->chunk)
+        avail = (off_t) ctx->chunk;
+      if (avail < 0) return -1;  /* EBUSY.                                    */
+      ctx->buf_len = 0;
+      in_buf = read_chunk(ctx->fd, ctx->buf, (size_t) avail, ctx->file_pos);
+      if (in_buf < 0) return -1;  /* read_chunk() already set {errno}.        */
+      if (in_buf == 0) { ctx->file_left = 0;  break; }  /* We've hit EOF.     */
+      ctx->buf_pos = ctx->file_pos;  ctx->buf_len = (size_t) in_buf;
+    }
+    /* in_buf > 0:  Got data to send.                                         */
+    avail = (in_buf < ctx->file_left ? in_buf : ctx->file_left);
+    if (pace(ctx, &avail)) return -1;  /* EAGAIN or EINTR.                    */
+    buf_ptr = (ssize_t) avail;
+    data = ctx->buf + (ctx->file_pos - ctx->buf_pos);
+    uncork(ctx, buf_ptr);
+    result = stubborn_send(data, &buf_ptr, ctx->sd, &budget);
+    /* On error, buf_ptr holds the part that went.                            */
+    STAT(bytes_read, buf_ptr);
+    digest_sent(ctx, data, buf_ptr);
+    pace_charge(ctx, buf_ptr);
+    ctx->sent      += buf_ptr;
+    ctx->file_pos  += buf_ptr;
+    ctx->file_left -= buf_ptr;
+    if (result == -1) return -1;  /* All errors OK.                           */
+  }
+
+  trace_phase(TEN4_PH_TRAILERS);
 
   /* Spool any trailers to the socket:                                        */
-  if (hdtr && (hdtr->trailers != NULL || hdtr->trlr_cnt != 0))
-  { IOVec *temp_iovv = hdtr->trailers;
-      int  temp_n    = hdtr->trlr_cnt;
-    off_t  temp_len  = 0;
-    if (spool_iovv(sd, &temp_iovv, &temp_n, &temp_len)) return -1; /* errno OK*/
-    *len += temp_len;
+  if (ctx->trlr_cnt > 0)
+  { uncork(ctx, ctx->trlr_len);
+    result = spool_iovv(ctx->sd, &ctx->trailers, &ctx->trlr_cnt,
+                        &ctx->trlr_skip, &temp_len, &budget);
+    ctx->sent     += temp_len;  /* Count whatever got sent, even if not all.  */
+    ctx->trlr_len -= temp_len;
+    if (result) return -1;  /* errno OK.                                      */
+    ctx->trlr_cnt = 0;
+  }
+
+  return 0;
+} /* end of step_transfer()                                                   */
+
+
+/* ten4_sendfile_step():                                                      *
+ * Moves as much of the transfer described by {*ctx} as it can:  first any    *
+ * headers not yet sent, then the file, then any trailers.  Returns 0 when    *
+ * everything has gone, or -1 with {errno} set appropriately.  EAGAIN means   *
+ * the socket filled up (at once, if nonblocking; otherwise after waiting as  *
+ * long as TEN4_OPT_TIMEOUT allows); calling again picks up where this left   *
+ * off.  EBUSY, likewise, means that file data was not yet in memory for      *
+ * TEN4_SF_NODISKIO.  Following any other error, the transfer should be       *
+ * abandoned.  Only EAGAIN leaves the socket corked, as more is then sure to  *
+ * follow as soon as it drains; after anything else, the caller's setting of  *
+ * TCP_NOPUSH is put back at once, lest what went last sit unsent meanwhile.  */
+int
+ten4_sendfile_step(Ten4_Ctx *ctx)
+{ int result = step_transfer(ctx);
+  if (result && errno != EAGAIN)
+  { int saved = errno;  /* Keep the step's errno across the setsockopt().     */
+    uncork(ctx, -1);
+    errno = saved;
+  }
+  return result;
+} /* end of ten4_sendfile_step()                                              */
+
+
+/* ten4_sendfile_finish():                                                    *
+ * Ends the transfer described by {*ctx}, whether or not it completed, and    *
+ * reports (via {len}, if that is not NULL) the total number of octets sent.  *
+ * Always returns 0.                                                          */
+int
+ten4_sendfile_finish(Ten4_Ctx *ctx, off_t *len)
+{ if (len != NULL) *len = (ctx != NULL ? ctx->sent : 0);
+  if (ctx != NULL)
+  { unmap_window(ctx);
+    pipe_stop(ctx);
+#ifdef F_NOCACHE
+    if (ctx->nocache) { fcntl(ctx->fd, F_NOCACHE, 0);  STAT(sys_fcntl, 1); }
+#endif
+    ctx->nocache = 0;
+    /* The low-water mark goes back first, as it may not exceed the buffer.   */
+    if (ctx->sndlowat >= 0)
+    { setsockopt(ctx->sd, SOL_SOCKET, SO_SNDLOWAT, &ctx->sndlowat,
+                 sizeof(ctx->sndlowat));
+      STAT(sys_sockopt, 1);
+    }
+    if (ctx->sndbuf > 0)
+    { setsockopt(ctx->sd, SOL_SOCKET, SO_SNDBUF, &ctx->sndbuf,
+                 sizeof(ctx->sndbuf));
+      STAT(sys_sockopt, 1);
+    }
+    ctx->sndbuf = 0;  ctx->sndlowat = -1;
+    uncork(ctx, -1);  /* In case the transfer stopped short.                  */
+    pool_put(ctx->buf, ctx->buf_sz);  ctx->buf = NULL;
+    cache_put(ctx->cached);  ctx->cached = NULL;
+  }
+  return 0;
+} /* end of ten4_sendfile_finish()                                            */
+
+
+/* ten4_sendfile_digest():                                                    *
+ * Has every file octet that {*ctx}'s transfer sends from now on passed to    *
+ * {fn}, along with {arg}, in order & as it goes - or stops that, if {fn} is  *
+ * NULL.  Returns 0, or -1 with {errno} = EFAULT if {ctx} is NULL.            */
+int
+ten4_sendfile_digest(Ten4_Ctx *ctx, Ten4_Digest fn, void *arg)
+{ if (ctx == NULL) { errno = EFAULT;  return -1; }
+  ctx->digest = fn;  ctx->digest_arg = arg;
+  return 0;
+} /* end of ten4_sendfile_digest()                                            */
+
+
+/* ten4_sendfile_pace():                                                      *
+ * Limits {*ctx}'s transfer to {rate} octets per second (or lifts the limit,  *
+ * if it is 0), on top of any TEN4_OPT_PACE_RATE.  Returns 0, or -1 with      *
+ * {errno} = EFAULT if {ctx} is NULL, or EINVAL if {rate} is negative.        */
+int
+ten4_sendfile_pace(Ten4_Ctx *ctx, int64_t rate)
+{ if (ctx == NULL) { errno = EFAULT;  return -1; }
+  if (rate < 0)    { errno = EINVAL;  return -1; }
+  ctx->pace_rate = rate;  ctx->pace_stamp = 0;  /* I.e., start with a burst.  */
+  ctx->paced = ((rate > 0 || opt_pace_rate > 0)
+                && ctx->hdr_len + ctx->file_left + ctx->trlr_len
+                   > opt_pace_burst);
+  return 0;
+} /* end of ten4_sendfile_pace()                                              */
+
+
+/* CRC-32, for ten4_crc32():                                                  *
+ * The "slicing-by-8" method, after Kounavis & Berry:  {crc_table[0]} is the  *
+ * usual byte-at-a-time table for the reflected polynomial 0xEDB88320, & each *
+ * {crc_table[k]} gives the effect of a byte followed by {k} zero octets, so  *
+ * that eight octets are folded in with eight independent lookups.  The       *
+ * octets are assembled into words one by one, which keeps it right on both   *
+ * big-endian PowerPC & little-endian Intel.                                  */
+static uint32_t       crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* crc_init():                                                                *
+ * Fills in {crc_table}, once per process.                                    */
+static void
+crc_init(void)
+{ for (uint32_t i = 0; i < 256; i++)
+  { uint32_t c = i;
+    for (int bit = 0; bit < 8; bit++)
+      c = (c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1);
+    crc_table[0][i] = c;
   }
+  for (uint32_t i = 0; i < 256; i++)
+    for (int k = 1; k < 8; k++)
+      crc_table[k][i] = (crc_table[k - 1][i] >> 8)
+                        ^ crc_table[0][crc_table[k - 1][i] & 0xFF];
+} /* end of crc_init()                                                        */
+
+/* ten4_crc32():                                                              *
+ * Returns {crc}, the CRC-32 of some earlier octets (or 0 for none), extended *
+ * over {len} more at {data}, exactly as zlib's crc32() does.                 */
+uint32_t
+ten4_crc32(uint32_t crc, const void *data, size_t len)
+{ const unsigned char *p = data;
+               uint32_t hi;
+  pthread_once(&crc_once, crc_init);
+  crc = ~crc;
+  for ( ; len >= 8; p += 8, len -= 8)
+  { crc ^= (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+           | (uint32_t) p[3] << 24;
+    hi   = (uint32_t) p[4] | (uint32_t) p[5] << 8 | (uint32_t) p[6] << 16
+           | (uint32_t) p[7] << 24;
+    crc  = crc_table[7][crc & 0xFF] ^ crc_table[6][(crc >> 8) & 0xFF]
+           ^ crc_table[5][(crc >> 16) & 0xFF] ^ crc_table[4][crc >> 24]
+           ^ crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF]
+           ^ crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+  }
+  while (len-- > 0)
+    crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+} /* end of ten4_crc32()                                                      */
+
+/* ten4_crc32_digest():                                                       *
+ * A digest callback for ten4_sendfile_digest(), keeping a running CRC-32 in  *
+ * the {uint32_t} that {arg} points to.                                       */
+void
+ten4_crc32_digest(void *arg, const void *data, size_t len)
+{ *(uint32_t *) arg = ten4_crc32(*(uint32_t *) arg, data, len);
+} /* end of ten4_crc32_digest()                                               */
+
+
+/* The prefetcher, for ten4_sendfile_prefetch():                              *
+ * One helper thread, started on first use & kept for the life of the         *
+ * process, works through a queue of file ranges that callers expect to send  *
+ * soon.  A file the content cache can take is read into it whole; any other  *
+ * range is handed to advise_range(), so that the kernel reads it in.  The    *
+ * queue is a ring of PREFETCH_SLOTS requests, & a request already covered by *
+ * one queued or under way is dropped.                                        */
+#define PREFETCH_SLOTS 64
+
+typedef struct {
+    int  fd;
+  off_t  offset,
+         len;     /* 0 meaning through end-of-file.                           */
+} Ten4_Prefetch;
+
+/* {prefetch_lock} guards {prefetcher}, & {prefetch_cond} is signalled        *
+ * whenever a request is queued.                                              */
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct {
+    Ten4_Prefetch  queue[PREFETCH_SLOTS];
+              int  head,     /* Index of the oldest request, &                */
+                   count;    /*   how many there are.                         */
+    Ten4_Prefetch  busy;     /* The request being carried out, if             */
+              int  working;  /*   this is set.                                */
+              int  started;  /* 1 once the thread is running, -1 if it could  *
+                              * not be started.                               */
+} prefetcher;
 
+/* prefetch_covers():                                                         *
+ * Says whether request {*have} takes in all of {*want}.                      */
+static int
+prefetch_covers(const Ten4_Prefetch *have, const Ten4_Prefetch *want)
+{ return (have->fd == want->fd && have->offset <= want->offset
+          && (have->len == 0
+              || (want->len != 0 && want->offset + want->len
+                                    <= have->offset + have->len)));
+} /* end of prefetch_covers()                                                 */
+
+/* prefetch_one():                                                            *
+ * Carries out request {*req}.  Any failure is simply ignored, as the later   *
+ * transfer will then read the file itself.                                   */
+static void
+prefetch_one(const Ten4_Prefetch *req)
+{ Ten4_Vc known;
+    off_t len = req->len;
+  if (check_file(req->fd, &known) || req->offset >= known.size) return;
+  if (len == 0 || len > known.size - req->offset)
+    len = known.size - req->offset;
+  if (opt_cache_max > 0)
+  { Ten4_CEntry *e = cache_get(req->fd, &known);
+    if (e != NULL) { cache_put(e);  STAT(prefetched, 1);  return; }
+  }
+  advise_range(req->fd, req->offset, len);
+  STAT(prefetched, 1);
+} /* end of prefetch_one()                                                    */
+
+/* prefetch_thread():                                                         *
+ * The helper thread's body:  takes requests oldest first, forever.           */
+static void *
+prefetch_thread(void *arg)
+{ (void) arg;
+  pthread_mutex_lock(&prefetch_lock);
+  for (;;)
+  { while (prefetcher.count == 0)
+      pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+    prefetcher.busy    = prefetcher.queue[prefetcher.head];
+    prefetcher.working = 1;
+    prefetcher.head    = (prefetcher.head + 1) % PREFETCH_SLOTS;
+    prefetcher.count--;
+    pthread_mutex_unlock(&prefetch_lock);
+    prefetch_one(&prefetcher.busy);  /* Safe:  only this thread changes it.   */
+    pthread_mutex_lock(&prefetch_lock);
+    prefetcher.working = 0;
+  }
+  return NULL;
+} /* end of prefetch_thread()                                                 */
+
+/* ten4_sendfile_prefetch():                                                  *
+ * Queues {len} octets of file {fd} from {offset} (all of it through end-of-  *
+ * file, if {len} is 0) to be read into memory ahead of sending, & returns at *
+ * once.  Returns 0, whether the request was queued or dropped as a repeat;   *
+ * or -1 with {errno} = EINVAL for a negative {offset} or {len}, or EAGAIN if *
+ * the queue is full.  If the helper thread cannot be started, the range is   *
+ * just handed to the kernel's read-ahead there & then.                       */
+int
+ten4_sendfile_prefetch(int fd, off_t offset, off_t len)
+{ Ten4_Prefetch  req;
+      pthread_t  thread;
+            int  result = 0;
+  pthread_once(&config_once, load_config);
+  if (fd < 0) { errno = EBADF;  return -1; }
+  if (offset < 0 || len < 0) { errno = EINVAL;  return -1; }
+  req.fd = fd;  req.offset = offset;  req.len = len;
+
+  pthread_mutex_lock(&prefetch_lock);
+  if (prefetcher.started == 0)
+  { prefetcher.started = (pthread_create(&thread, NULL, prefetch_thread, NULL)
+                          == 0 ? 1 : -1);
+    if (prefetcher.started == 1) pthread_detach(thread);
+  }
+  if (prefetcher.started < 0)
+  { pthread_mutex_unlock(&prefetch_lock);
+    advise_range(fd, offset, len);
+    return 0;
+  }
+  if (prefetcher.working && prefetch_covers(&prefetcher.busy, &req))
+    result = 1;
+  for (int i = 0; i < prefetcher.count && result == 0; i++)
+    if (prefetch_covers(&prefetcher.queue[(prefetcher.head + i)
+                                          % PREFETCH_SLOTS], &req))
+      result = 1;
+  if (result == 0 && prefetcher.count == PREFETCH_SLOTS)
+    result = -1;
+  if (result == 0)
+  { prefetcher.queue[(prefetcher.head + prefetcher.count++) % PREFETCH_SLOTS]
+      = req;
+    pthread_cond_signal(&prefetch_cond);
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+  if (result > 0) { STAT(prefetch_dups, 1);  return 0; }
+  if (result < 0) { errno = EAGAIN;  return -1; }
   return 0;
+} /* end of ten4_sendfile_prefetch()                                          */
+
+
+/* The asynchronous engine:                                                   *
+ * Drives many transfers at once from one thread, each advancing only when    *
+ * its socket can take more.  With kqueue, each waiting transfer has a one-   *
+ * shot EVFILT_WRITE event registered, carrying its context; with poll(), the *
+ * loop instead polls every pending transfer's socket on each run.  Either    *
+ * way, each pending context is on the loop's list, so that none is lost.     */
+#define LOOP_BATCH 64  /* Most events to take from the kernel per run.        */
+
+#ifndef ECANCELED
+#define ECANCELED EINTR
+#endif
+
+struct ten4_loop {
+             int   kq;       /* The loop's kqueue, or -1 if it uses poll().   */
+             int   pending;  /* Transfers not yet called back.                */
+        Ten4_Ctx  *active;   /* The list of them.                             */
+   struct pollfd  *pfd;      /* For poll():  scratch space for {room} sockets */
+        Ten4_Ctx **pctx;     /* & their contexts.                             */
+             int   room;
+             int   wake;     /* Readable when a run is to end early, or -1.   */
+};
+
+Ten4_Loop *
+ten4_loop_create(void)
+{ Ten4_Loop *loop;
+  pthread_once(&config_once, load_config);
+  if ((loop = calloc(1, sizeof(Ten4_Loop))) == NULL)
+  { errno = ENOMEM;  return NULL; }
+  loop->kq = loop->wake = -1;
+#ifdef TEN4_HAVE_KQUEUE
+  loop->kq = kqueue();  /* If this fails, poll() will have to do.             */
+#endif
+  return loop;
+} /* end of ten4_loop_create()                                                */
+
+
+/* loop_wake_on():                                                            *
+ * Has {loop}'s runs end early whenever nonblocking descriptor {fd} becomes   *
+ * readable, as the worker pool's pipes do when there is new work queued.     *
+ * Returns 0, or -1 with {errno} set.                                         */
+static int
+loop_wake_on(Ten4_Loop *loop, int fd)
+{
+#ifdef TEN4_HAVE_KQUEUE
+  if (loop->kq >= 0)
+  { struct kevent change;
+    EV_SET(&change, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (kevent(loop->kq, &change, 1, NULL, 0, NULL) == -1) return -1;
+  }
+#endif
+  loop->wake = fd;
+  return 0;
+} /* end of loop_wake_on()                                                    */
+
+/* loop_woken():                                                              *
+ * Empties {loop}'s wake descriptor, so that it stops being readable.         */
+static void
+loop_woken(Ten4_Loop *loop)
+{ char sink[64];
+  while (read(loop->wake, sink, sizeof(sink)) > 0) ;
+} /* end of loop_woken()                                                      */
+
+
+/* async_done():                                                              *
+ * Ends {*ctx}'s transfer, with outcome {err}, & calls back its owner.        */
+static void
+async_done(Ten4_Ctx *ctx, int err)
+{ Ten4_Loop *loop = ctx->loop;
+      off_t  len;
+  ten4_sendfile_finish(ctx, &len);
+  if (ctx->prev != NULL) ctx->prev->next = ctx->next;
+  else loop->active = ctx->next;
+  if (ctx->next != NULL) ctx->next->prev = ctx->prev;
+  ctx->prev = ctx->next = NULL;  ctx->loop = NULL;
+  loop->pending--;
+  ctx->done(ctx, err, len, ctx->done_arg);  /* Last; it may free {*ctx}.      */
+} /* end of async_done()                                                      */
+
+
+/* async_wait():                                                              *
+ * Arranges for {*ctx} to be moved along once its socket is writable.         *
+ * Returns 0, or -1 with {errno} set.                                         */
+static int
+async_wait(Ten4_Ctx *ctx)
+{
+#ifdef TEN4_HAVE_KQUEUE
+  if (ctx->loop->kq >= 0)
+  { struct kevent change;
+#ifdef EVFILT_TIMER
+    /* A transfer held back by pacing waits for its tokens instead, unless    *
+     * the kernel has no timers (10.3), when the socket's writability must    *
+     * stand in for one.                                                      */
+    if (ctx->pace_due > 0)
+    { int64_t wait = ctx->pace_due - usecs_now();
+      EV_SET(&change, (uintptr_t) ctx, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+             (wait > 0 ? (wait + 999) / 1000 : 0), ctx);
+      if (kevent(ctx->loop->kq, &change, 1, NULL, 0, NULL) == 0) return 0;
+    }
+#endif
+    EV_SET(&change, ctx->sd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, ctx);
+    return (kevent(ctx->loop->kq, &change, 1, NULL, 0, NULL) == -1 ? -1 : 0);
+  }
+#endif
+  (void) ctx;  /* poll() finds it on the loop's list.                         */
+  return 0;
+} /* end of async_wait()                                                      */
+
+
+/* async_advance():                                                           *
+ * Sends as much more of {*ctx}'s transfer as its socket will take, then      *
+ * either waits for it to take more or calls the transfer's owner back.       *
+ * Returns 1 if it did the latter, else 0.                                    */
+static int
+async_advance(Ten4_Ctx *ctx)
+{ if (ten4_sendfile_step(ctx) == 0) { async_done(ctx, 0);  return 1; }
+  if ((errno == EAGAIN || errno == EINTR) && async_wait(ctx) == 0) return 0;
+  async_done(ctx, errno);
+  return 1;
+} /* end of async_advance()                                                   */
+
+
+/* ten4_sendfile_async():                                                     *
+ * Starts {*ctx}'s transfer on {loop}, to call {done} back when it ends.      *
+ * Returns 0 once the transfer is under way (or over), or -1 with {errno} set *
+ * to EFAULT (a NULL argument), EBUSY ({*ctx} is already on a loop) or EINVAL *
+ * ({*ctx}'s socket is not marked for nonblocking I/O); the context is then   *
+ * left as it was, & no callback will be made.                                */
+int
+ten4_sendfile_async(Ten4_Ctx *ctx, Ten4_Loop *loop, Ten4_Done done, void *arg)
+{ if (ctx == NULL || loop == NULL || done == NULL)
+  { errno = EFAULT;  return -1; }
+  if (ctx->loop != NULL) { errno = EBUSY;  return -1; }
+  if (! ctx->nonblocking) { errno = EINVAL;  return -1; }
+  ctx->loop = loop;  ctx->done = done;  ctx->done_arg = arg;
+  ctx->prev = NULL;
+  if ((ctx->next = loop->active) != NULL) loop->active->prev = ctx;
+  loop->active = ctx;
+  loop->pending++;
+  async_advance(ctx);
+  return 0;
+} /* end of ten4_sendfile_async()                                             */
+
+
+/* ten4_loop_run():                                                           *
+ * Waits up to {timeout_ms} milliseconds (or forever, if negative) for any of *
+ * {loop}'s pending transfers' sockets to become writable, & moves those that *
+ * do along.  Returns the number of transfers called back, or -1 with {errno} *
+ * set (EINTR, if a signal cut the wait short).                               */
+int
+ten4_loop_run(Ten4_Loop *loop, int timeout_ms)
+{     int completed = 0,
+          n         = 0;
+  int64_t now,
+          soonest   = -1;  /* For poll():  microseconds until a pacing wait   *
+                            * ends, if any transfer is in one.                */
+  if (loop == NULL) { errno = EFAULT;  return -1; }
+  if (loop->pending == 0) return 0;
+#ifdef TEN4_HAVE_KQUEUE
+  if (loop->kq >= 0)
+  { struct kevent  ready[LOOP_BATCH];
+         Timespec  wait;
+    wait.tv_sec  = timeout_ms / 1000;
+    wait.tv_nsec = (long) (timeout_ms % 1000) * 1000000;
+    if ((n = kevent(loop->kq, NULL, 0, ready, LOOP_BATCH,
+                    (timeout_ms < 0 ? NULL : &wait))) == -1)
+      return -1;
+    for (int i = 0; i < n; i++)
+      if (ready[i].udata == NULL) loop_woken(loop);
+      else completed += async_advance(ready[i].udata);
+    return completed;
+  }
+#endif
+  /* With poll():  Snapshot the list, since callbacks may change it.          */
+  if (loop->room < loop->pending + 1)  /* One more, for the wake descriptor.  */
+  { struct pollfd *pfd;
+         Ten4_Ctx **pctx;
+              int  room = (loop->pending + 1) * 2;
+    if ((pfd = realloc(loop->pfd, room * sizeof(struct pollfd))) != NULL)
+      loop->pfd = pfd;
+    if ((pctx = realloc(loop->pctx, room * sizeof(Ten4_Ctx *))) != NULL)
+      loop->pctx = pctx;
+    if (pfd == NULL || pctx == NULL) { errno = ENOMEM;  return -1; }
+    loop->room = room;
+  }
+  /* A transfer held back by pacing is left out (poll() skips any negative    *
+   * descriptor), & the wait cut short for the first of them to be due.       */
+  now = usecs_now();
+  for (Ten4_Ctx *ctx = loop->active; ctx != NULL; ctx = ctx->next, n++)
+  { loop->pfd[n].fd = ctx->sd;  loop->pfd[n].events = POLLOUT;
+    loop->pfd[n].revents = 0;   loop->pctx[n] = ctx;
+    if (ctx->pace_due > now)
+    { loop->pfd[n].fd = -1;
+      if (soonest < 0 || ctx->pace_due - now < soonest)
+        soonest = ctx->pace_due - now;
+    }
+  }
+  loop->pfd[n].fd = loop->wake;  loop->pfd[n].events = POLLIN;
+  loop->pfd[n].revents = 0;
+  if (soonest >= 0 && (timeout_ms < 0 || (soonest + 999) / 1000 < timeout_ms))
+    timeout_ms = (int) ((soonest + 999) / 1000);
+  if (poll(loop->pfd, (nfds_t) n + 1, timeout_ms) == -1) return -1;
+  if (loop->pfd[n].revents != 0) loop_woken(loop);
+  now = usecs_now();
+  for (int i = 0; i < n; i++)
+    if (loop->pfd[i].revents != 0
+        || (loop->pfd[i].fd < 0 && loop->pctx[i]->pace_due <= now))
+      completed += async_advance(loop->pctx[i]);
+  return completed;
+} /* end of ten4_loop_run()                                                   */
+
+
+int
+ten4_loop_fd(Ten4_Loop *loop)
+{ return (loop != NULL ? loop->kq : -1); }
+
+int
+ten4_loop_pending(Ten4_Loop *loop)
+{ return (loop != NULL ? loop->pending : 0); }
+
+
+/* ten4_loop_destroy():                                                       *
+ * Calls back every transfer still pending on {loop}, as cancelled, & then    *
+ * frees the loop.                                                            */
+void
+ten4_loop_destroy(Ten4_Loop *loop)
+{ if (loop == NULL) return;
+  while (loop->active != NULL) async_done(loop->active, ECANCELED);
+  if (loop->kq >= 0) close(loop->kq);  /* Taking its registrations with it.   */
+  free(loop->pfd);  free(loop->pctx);
+  free(loop);
+} /* end of ten4_loop_destroy()                                               */
+
+
+/* The worker pool:                                                           *
+ * Each worker has a loop of its own, & a queue of contexts not yet started,  *
+ * linked through their {prev} & {next} members (which a loop only uses once  *
+ * a transfer is started on it).  The owner takes from the tail of its queue, *
+ * & thieves from the head.  Without atomic operations on Mac OS 10.3, each   *
+ * queue has a lock; the pool's lock guards only the count of everything      *
+ * queued, which lets idle workers sleep until there is something to take.    *
+ * A busy worker, waiting on its loop instead, is woken through a pipe when   *
+ * work is queued for it, so the tick only bounds how long it can go without  *
+ * looking for work to steal.                                                 */
+#define POOL_TICK_MS 10  /* Longest a busy worker waits on its loop at once.  */
+
+typedef struct ten4_worker {
+        pthread_t  thread;
+        Ten4_Pool *pool;
+        Ten4_Loop *loop;
+  pthread_mutex_t  lock;         /* Guards the queue.                         */
+         Ten4_Ctx *head, *tail;  /* The queue.                                */
+              int  wake[2];      /* A pipe, read by {loop}, to wake {thread}. */
+} Ten4_Worker;
+
+struct ten4_pool {
+      Ten4_Worker *worker;
+              int  n_workers;
+  pthread_mutex_t  lock;         /* Guards the rest.                          */
+   pthread_cond_t  cond;         /* Signalled when work is queued, or on quit.*/
+              int  queued;       /* Contexts queued, in all queues together.  */
+              int  idle;         /* Workers waiting on {cond}.                */
+              int  quit;
+         unsigned  next;         /* The worker to queue for next.             */
+};
+
+/* pool_cancel():                                                             *
+ * Ends a queued context's transfer unstarted, & calls back its owner.        */
+static void
+pool_cancel(Ten4_Ctx *ctx)
+{ off_t len;
+  ctx->prev = ctx->next = NULL;
+  ten4_sendfile_finish(ctx, &len);
+  ctx->done(ctx, ECANCELED, len, ctx->done_arg);
+} /* end of pool_cancel()                                                     */
+
+/* pool_take():                                                               *
+ * Removes a context from the tail (if {own}) or head of {*w}'s queue, & then *
+ * updates the pool's count.  Returns the context, or NULL if none was there. */
+static Ten4_Ctx *
+pool_take(Ten4_Worker *w, int own)
+{ Ten4_Ctx *ctx;
+  pthread_mutex_lock(&w->lock);
+  if ((ctx = (own ? w->tail : w->head)) != NULL)
+  { if (ctx->prev != NULL) ctx->prev->next = ctx->next;
+    else w->head = ctx->next;
+    if (ctx->next != NULL) ctx->next->prev = ctx->prev;
+    else w->tail = ctx->prev;
+    ctx->prev = ctx->next = NULL;
+  }
+  pthread_mutex_unlock(&w->lock);
+  if (ctx != NULL)
+  { pthread_mutex_lock(&w->pool->lock);
+    w->pool->queued--;
+    pthread_mutex_unlock(&w->pool->lock);
+  }
+  return ctx;
+} /* end of pool_take()                                                       */
+
+/* pool_worker():                                                             *
+ * A worker thread's body.  It starts whatever it can get from the queues,    *
+ * moving its started transfers along in between, & sleeps when there is      *
+ * nothing to do at all.                                                      */
+static void *
+pool_worker(void *arg)
+{ Ten4_Worker *w    = arg;
+    Ten4_Pool *pool = w->pool;
+     Ten4_Ctx *ctx;
+          int  quit = 0;
+  while (! quit)
+  { ctx = pool_take(w, 1);
+    for (int i = 1; ctx == NULL && i < pool->n_workers; i++)
+      ctx = pool_take(&pool->worker[(w - pool->worker + i) % pool->n_workers],
+                      0);
+    if (ctx != NULL)
+    { if (ten4_sendfile_async(ctx, w->loop, ctx->done, ctx->done_arg))
+        pool_cancel(ctx);  /* Can only be if the submitter broke the rules.   */
+      ten4_loop_run(w->loop, 0);  /* Keep the started ones moving, too.       */
+    }
+    else if (ten4_loop_pending(w->loop) > 0)
+      ten4_loop_run(w->loop, POOL_TICK_MS);
+    pthread_mutex_lock(&pool->lock);
+    while (! pool->quit && pool->queued == 0 && ten4_loop_pending(w->loop) == 0)
+    { pool->idle++;
+      pthread_cond_wait(&pool->cond, &pool->lock);
+      pool->idle--;
+    }
+    quit = pool->quit;
+    pthread_mutex_unlock(&pool->lock);
+  }
+  ten4_loop_destroy(w->loop);  /* Cancelling what it had started.             */
+  return NULL;
+} /* end of pool_worker()                                                     */
+
+
+Ten4_Pool *
+ten4_pool_create(int threads)
+{ Ten4_Pool *pool;
+        int  started = 0;
+  pthread_once(&config_once, load_config);
+  if (threads <= 0)
+  {
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads <= 0) threads = 1;
+  }
+  if ((pool = calloc(1, sizeof(Ten4_Pool))) == NULL
+      || (pool->worker = calloc(threads, sizeof(Ten4_Worker))) == NULL)
+  { free(pool);  errno = ENOMEM;  return NULL; }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  /* All the workers must exist before any can try stealing from the others.  */
+  for (int i = 0; i < threads; i++)
+  { Ten4_Worker *w = &pool->worker[i];
+    w->pool = pool;
+    if ((w->loop = ten4_loop_create()) == NULL) break;
+    if (pipe(w->wake))
+    { ten4_loop_destroy(w->loop);  break; }
+    if (fcntl(w->wake[0], F_SETFL, O_NONBLOCK) == -1
+        || fcntl(w->wake[1], F_SETFL, O_NONBLOCK) == -1
+        || loop_wake_on(w->loop, w->wake[0]))
+    { ten4_loop_destroy(w->loop);  close(w->wake[0]);  close(w->wake[1]);
+      break;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pool->n_workers++;
+  }
+  while (started < pool->n_workers
+         && pthread_create(&pool->worker[started].thread, NULL, pool_worker,
+                           &pool->worker[started]) == 0)
+    started++;
+  if (started == pool->n_workers && started > 0) return pool;
+
+  /* Undo the lot.  Such workers as are already running must be told to stop, *
+   * & will take their loops with them.                                       */
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < started; i++) pthread_join(pool->worker[i].thread, NULL);
+  for (int i = 0; i < pool->n_workers; i++)
+  { if (i >= started) ten4_loop_destroy(pool->worker[i].loop);
+    pthread_mutex_destroy(&pool->worker[i].lock);
+    close(pool->worker[i].wake[0]);  close(pool->worker[i].wake[1]);
+  }
+  pthread_cond_destroy(&pool->cond);  pthread_mutex_destroy(&pool->lock);
+  /* No worker at all means no memory (or descriptors); otherwise,            *
+   * pthread_create() failed.                                                 */
+  errno = (pool->n_workers == 0 ? ENOMEM : EAGAIN);
+  free(pool->worker);  free(pool);
+  return NULL;
+} /* end of ten4_pool_create()                                                */
+
+
+/* ten4_pool_submit():                                                        *
+ * Queues {*ctx}'s transfer on {pool}, to call {done} back when it ends.      *
+ * Returns 0, or -1 with {errno} set as ten4_sendfile_async() would set it;   *
+ * the context is then left as it was, & no callback will be made.            */
+int
+ten4_pool_submit(Ten4_Pool *pool, Ten4_Ctx *ctx, Ten4_Done done, void *arg)
+{ Ten4_Worker *w;
+          int  poke;
+  if (pool == NULL || ctx == NULL || done == NULL)
+  { errno = EFAULT;  return -1; }
+  if (ctx->loop != NULL) { errno = EBUSY;  return -1; }
+  if (! ctx->nonblocking) { errno = EINVAL;  return -1; }
+  ctx->done = done;  ctx->done_arg = arg;
+  ctx->flags |= TEN4_SF_RDADVISE;
+  pthread_mutex_lock(&pool->lock);
+  w = &pool->worker[pool->next++ % pool->n_workers];
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_lock(&w->lock);
+  ctx->next = NULL;
+  if ((ctx->prev = w->tail) != NULL) w->tail->next = ctx;
+  else w->head = ctx;
+  w->tail = ctx;
+  pthread_mutex_unlock(&w->lock);
+  pthread_mutex_lock(&pool->lock);
+  pool->queued++;
+  /* Wake an idle worker to take it, or else the busy one it was queued for.  *
+   * If that one's pipe is full, it has been woken already.                   */
+  if ((poke = (pool->idle == 0)) == 0) pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  if (poke) { char nudge = 0;  (void) write(w->wake[1], &nudge, 1); }
+  return 0;
+} /* end of ten4_pool_submit()                                                */
+
+
+void
+ten4_pool_destroy(Ten4_Pool *pool)
+{ Ten4_Ctx *ctx;
+  if (pool == NULL) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->n_workers; i++)
+    pthread_join(pool->worker[i].thread, NULL);
+  for (int i = 0; i < pool->n_workers; i++)
+  { while ((ctx = pool_take(&pool->worker[i], 0)) != NULL) pool_cancel(ctx);
+    pthread_mutex_destroy(&pool->worker[i].lock);
+    close(pool->worker[i].wake[0]);  close(pool->worker[i].wake[1]);
+  }
+  pthread_cond_destroy(&pool->cond);  pthread_mutex_destroy(&pool->lock);
+  free(pool->worker);  free(pool);
+} /* end of ten4_pool_destroy()                                               */
+
+
+/* stats_total():                                                             *
+ * Sums every thread's counts, living or gone, into {*stats}.  The caller     *
+ * must hold {tls_lock}.                                                      */
+static void
+stats_total(Ten4_Stats *stats)
+{ *stats = stats_gone;
+  for (Ten4_Tls *tls = tls_list; tls != NULL; tls = tls->next)
+    stats_add(stats, &tls->stats, 1);
+} /* end of stats_total()                                                     */
+
+/* ten4_sendfile_stats():                                                     *
+ * Fills in {*stats} with the counts for the whole process since the last     *
+ * reset.  Returns 0 on success, or -1 with {errno} set to EFAULT if {stats}  *
+ * is NULL.                                                                   */
+int
+ten4_sendfile_stats(Ten4_Stats *stats)
+{ if (stats == NULL) { errno = EFAULT;  return -1; }
+  pthread_mutex_lock(&tls_lock);
+  stats_total(stats);
+  stats_add(stats, &stats_base, -1);
+  pthread_mutex_unlock(&tls_lock);
+  return 0;
+} /* end of ten4_sendfile_stats()                                             */
+
+/* ten4_sendfile_stats_reset():                                               *
+ * Zeroes the counts, as ten4_sendfile_stats() reports them.  The threads'    *
+ * own counts are not touched, as only their owners may write to them; what   *
+ * they add up to now is instead taken as the new baseline.                   */
+void
+ten4_sendfile_stats_reset(void)
+{ pthread_mutex_lock(&tls_lock);
+  stats_total(&stats_base);
+  pthread_mutex_unlock(&tls_lock);
+} /* end of ten4_sendfile_stats_reset()                                       */
+
+
+/* find_native():                                                             *
+ * Looks for the kernel-backed sendfile() that libSystem exports from Mac OS  *
+ * 10.5 (Darwin 9) onward, once per process.  On 10.4 & earlier, the symbol   *
+ * is either absent or a stub, so the Darwin release is checked as well.      */
+typedef int (*Sendfile_Fn)(int, int, off_t, off_t *, Sf_HdTr *, int);
+
+static pthread_once_t native_once = PTHREAD_ONCE_INIT;
+static Sendfile_Fn    native_fn   = NULL;
+
+static void
+find_native(void)
+{
+#ifdef __APPLE__
+  struct utsname  names;
+            void *lib;
+     Sendfile_Fn  fn;
+  if (uname(&names) || atoi(names.release) < 9) return;
+  if ((lib = dlopen(TEN4_LIBSYSTEM, RTLD_LAZY | RTLD_LOCAL)) == NULL) return;
+  fn = (Sendfile_Fn) dlsym(lib, "sendfile");
+  if (fn != NULL && fn != sendfile) native_fn = fn;  /* Never ourselves!      */
+#endif
+} /* end of find_native()                                                     */
+
+/* cache_warm():                                                              *
+ * Returns 1 if the content cache holds the current contents of file {fd}, so *
+ * that sending them from it beats handing the call to the kernel; else 0.    */
+static int
+cache_warm(int fd)
+{     Ten4_Vc  known;
+   Ten4_Shard *sh;
+  Ten4_CEntry *e;
+     unsigned  hash;
+  if (opt_cache_max <= 0 || check_file(fd, &known)
+      || known.size <= 0 || known.size > opt_cache_file)
+    return 0;
+  pthread_once(&shards_once, shards_init);
+  hash = cache_hash(known.dev, known.ino);
+  sh = &shards[hash % CACHE_SHARDS];
+  hash = (hash / CACHE_SHARDS) % CACHE_BUCKETS;
+  pthread_mutex_lock(&sh->lock);
+  for (e = sh->bucket[hash]; e != NULL; e = e->hnext)
+    if (e->dev == known.dev && e->ino == known.ino) break;
+  hash = (e != NULL && e->mtime == known.mtime && e->size == known.size);
+  pthread_mutex_unlock(&sh->lock);
+  return (int) hash;
+} /* end of cache_warm()                                                      */
+
+
+int
+sendfile (int  fd,      /* Descriptor for the file to send.                   */
+          int  sd,      /* Descriptor for the socket to send to.              */
+        off_t  offset,  /* {int64_t}.  Index of the first file octet to send. */
+        off_t *len,     /* In:  Number of octets to read from the file.       *
+                         * Out:  Total number of octets written (headers,     *
+                                 file, and trailers combined).                */
+      Sf_HdTr *hdtr,    /* Optional header and/or trailer data.               */
+          int  flags    /* Reserved.  Return an error if nonzero.             */
+         )
+{      Ten4_Ctx  ctx;     /* A one-shot transfer is just a resumable one      *
+                           * that is never resumed, done all in one go.       */
+            int  result;  /* For subroutine calls.                            */
+        Timeval  start;   /* When the call began, for the statistics.         */
+  Ten4_TraceRec  rec;     /* The call's trace record, if tracing.             */
+  /* Sanity-check the arguments.                                              */
+  if (len == NULL) { errno = EINVAL;  return -1; }
+  gettimeofday(&start, NULL);
+  /* Hand plain calls to the kernel, where there is a sendfile() in it, save  *
+   * for files the content cache already holds.  The kernel counts headers in *
+   * a nonzero {*len}, as this library does not, so their length is added on. *
+   * A filesystem it can't send from still gets the emulation, though - but   *
+   * only if nothing at all went out, lest any of it go twice.                */
+  pthread_once(&config_once, load_config);
+  pthread_once(&native_once, find_native);
+  if (trace_on) trace_begin(&rec, fd, sd, offset, *len, &start);
+  if (native_fn != NULL && opt_native && flags == 0 && opt_flags == 0
+      && opt_pace_rate == 0
+      && (hdtr == NULL
+          || (hdtr->hdr_cnt <= IOV_MAX && hdtr->trlr_cnt <= IOV_MAX))
+      && ! cache_warm(fd))
+  {   off_t asked   = *len;
+    ssize_t hdr_len = (hdtr != NULL && hdtr->hdr_cnt != 0
+                       ? check_iovv(hdtr->headers, hdtr->hdr_cnt) : 0);
+    if (hdr_len >= 0)  /* Else leave the emulation to report the error.       */
+    { if (asked > 0) *len = asked + hdr_len;
+      result = native_fn(fd, sd, offset, len, hdtr, flags);
+      if (result == 0 || errno != EOPNOTSUPP || *len != 0)
+      { STAT(calls_native, 1);  STAT(bytes_native, *len);
+        trace_end(result, *len, 1);
+        stat_latency(&start);
+        return result;
+      }
+    }
+    *len = asked;
+  }
+  STAT(calls_emulated, 1);
+  result = ten4_sendfile_init(&ctx, fd, sd, offset, *len, hdtr, flags);
+  *len = 0;  /* This is the correct value for all the validation errors.      */
+  if (result)  /* errno OK.                                                   */
+  { trace_end(result, 0, 0);  stat_latency(&start);  return -1; }
+  trace_phase(TEN4_PH_HEADERS);
+  result = ten4_sendfile_step(&ctx);
+  { int saved = errno;  /* Keep step's errno across the clean-up.             */
+    ten4_sendfile_finish(&ctx, len);
+    errno = saved;
+  }
+  trace_end(result, *len, 0);
+  stat_latency(&start);
+  return result;
 } /* end of sendfile()                                                        */
+
+
+/* The staging area for sendfilev():                                          *
+ * Memory pieces, & small file ranges read into a pooled buffer, wait here    *
+ * until there are enough of them (or something bigger comes along) to be     *
+ * worth a writev() - or to go along as the headers of a large file range.    */
+typedef struct {
+   IOVec  iov[COALESCE_IOVS];
+     int  cnt;                /* Number of {iov} entries in use.              */
+    char *buf;                /* Holds the staged file data, or is NULL.      */
+  size_t  buf_sz;             /* Its capacity.                                */
+  size_t  used;               /* Octets of it filled so far.                  */
+} Ten4_Stage;
+
+/* stage_flush():                                                             *
+ * Sends everything in {*stage} to socket {sd}, adding the octets that went   *
+ * to {*total}, & empties it whether or not they all did.  Returns 0, or -1   *
+ * with {errno} set as for spool_iovv().                                      */
+static int
+stage_flush(int sd, Ten4_Stage *stage, int64_t *budget, off_t *total)
+{  IOVec *iovv   = stage->iov;
+   off_t  done   = 0;
+  size_t  skip   = 0;
+     int  result = 0;
+  if (stage->cnt > 0)
+  { result = spool_iovv(sd, &iovv, &stage->cnt, &skip, &done, budget);
+    *total += done;  /* Count whatever got sent, even if not all.             */
+  }
+  stage->cnt = 0;  stage->used = 0;
+  return result;
+} /* end of stage_flush()                                                     */
+
+/* stage_file():                                                              *
+ * Reads {len} octets of file {fd} from offset {pos} (or as many as there are *
+ * before end-of-file) into {*stage}, which must have room.  Returns 0, or -1 *
+ * with {errno} set to something sendfile() may return.                       */
+static int
+stage_file(Ten4_Stage *stage, int fd, off_t pos, size_t len)
+{ ssize_t got;
+   size_t have = 0;
+  if (stage->buf == NULL)
+  { stage->buf_sz = (size_t) opt_coalesce;
+    if ((stage->buf = pool_get(&stage->buf_sz)) == NULL)
+    { errno = ENOMEM;  return -1; }
+  }
+  while (have < len)
+  { got = read_chunk(fd, stage->buf + stage->used + have, len - have,
+                     pos + (off_t) have);
+    if (got < 0) return -1;  /* read_chunk() already set {errno} to suit.     */
+    if (got == 0) break;     /* We've hit EOF.                                */
+    have += (size_t) got;
+  }
+  if (have > 0)
+  { stage->iov[stage->cnt].iov_base = stage->buf + stage->used;
+    stage->iov[stage->cnt].iov_len  = have;
+    stage->cnt++;  stage->used += have;
+  }
+  return 0;
+} /* end of stage_file()                                                      */
+
+
+ssize_t
+sendfilev(   int  sd,       /* Descriptor for the socket to send to.          */
+    const Sf_Vec *vec,      /* The pieces to send, in order.                  */
+             int  vec_cnt,  /* How many there are.                            */
+          size_t *xferred   /* Out:  Total number of octets sent.             */
+         )
+{ Ten4_Stage  stage;        /* Small pieces waiting to go out together.       */
+    Ten4_Ctx  ctx;          /* For each file range too big to stage.          */
+     Ten4_Vc  known;        /* For checking the staged files.                 */
+     Sf_HdTr  hdtr;
+       off_t  total = 0,    /* Octets sent so far.                            */
+              done;
+     int64_t  budget;       /* Microseconds we may yet wait on {sd}.          */
+     Timeval  start;        /* When the call began, for the statistics.       */
+         int  checked = -1, /* The file last found to be regular.             */
+              result = 0,
+              saved;
+  /* Sanity-check the arguments, & the socket once for all.                   */
+  pthread_once(&config_once, load_config);
+  if (xferred == NULL || (vec == NULL && vec_cnt > 0))
+  { errno = EFAULT;  return -1; }
+  *xferred = 0;
+  if (vec_cnt < 0) { errno = EINVAL;  return -1; }
+  gettimeofday(&start, NULL);
+  if (check_socket(sd)) return -1;  /* errno OK.                              */
+  STAT(sys_fcntl, 1);
+  if ((result = fcntl(sd, F_GETFL)) == -1) return -1;  /* EBADF is OK.        */
+  budget = ((result & O_NONBLOCK) ? 0 : opt_timeout_ms < 0 ? -1
+            : opt_timeout_ms * 1000);
+  result = 0;
+  stage.cnt = 0;  stage.buf = NULL;  stage.buf_sz = 0;  stage.used = 0;
+
+  for (int i = 0; i < vec_cnt && result == 0; i++)
+  { const Sf_Vec *v = &vec[i];
+    if (v->sfv_flag != 0) { errno = EINVAL;  result = -1;  break; }
+    if (v->sfv_len == 0) continue;
+    if (v->sfv_fd == SFV_FD_SELF)  /* Memory goes straight onto the stage.    */
+    { if (stage.cnt == COALESCE_IOVS
+          && (result = stage_flush(sd, &stage, &budget, &total)) != 0)
+        break;
+      stage.iov[stage.cnt].iov_base = (void *) (size_t) v->sfv_off;
+      stage.iov[stage.cnt].iov_len  = v->sfv_len;
+      stage.cnt++;
+      continue;
+    }
+    if (v->sfv_off < 0) { errno = EINVAL;  result = -1;  break; }
+    if (v->sfv_len <= (size_t) opt_coalesce)  /* A small range is staged too. */
+    { if (stage.cnt == COALESCE_IOVS
+          || stage.used + v->sfv_len > (size_t) opt_coalesce)
+        if ((result = stage_flush(sd, &stage, &budget, &total)) != 0) break;
+      if (v->sfv_fd != checked && (result = check_file(v->sfv_fd, &known)) != 0)
+        break;
+      checked = v->sfv_fd;
+      result = stage_file(&stage, v->sfv_fd, v->sfv_off, v->sfv_len);
+      continue;
+    }
+    /* A large range is sent by the usual engine, with whatever is staged     *
+     * going ahead of it as its headers (so perhaps in the same writev()).    */
+    hdtr.headers  = stage.iov;  hdtr.hdr_cnt  = stage.cnt;
+    hdtr.trailers = NULL;       hdtr.trlr_cnt = 0;
+    if ((result = setup(&ctx, v->sfv_fd, sd, v->sfv_off, (off_t) v->sfv_len,
+                        (stage.cnt > 0 ? &hdtr : NULL), 0, 0)) != 0)
+      break;
+    if (ctx.hdr_cnt < stage.cnt)  /* Starts past EOF; the stage must wait.    */
+    { ten4_sendfile_finish(&ctx, NULL);  continue; }
+    result = ten4_sendfile_step(&ctx);
+    saved = errno;  /* Keep step's errno across the clean-up.                 */
+    ten4_sendfile_finish(&ctx, &done);
+    errno = saved;
+    total += done;
+    stage.cnt = 0;  stage.used = 0;
+  }
+  if (result == 0) result = stage_flush(sd, &stage, &budget, &total);
+  saved = errno;
+  pool_put(stage.buf, stage.buf_sz);
+  errno = saved;
+  *xferred = (size_t) total;
+  stat_latency(&start);
+  return (result ? -1 : (ssize_t) total);
+} /* end of sendfilev()                                                       */
+
+
+/* Multipart byte ranges, for ten4_sendfile_ranges():                         *
+ * The ranges asked for are merged into parts, each of which gets a header    *
+ * of its own.  Those headers, & the closing boundary, are all generated into *
+ * one block of text, & the lot is then handed to sendfilev() as a list of    *
+ * memory pieces & file ranges, so that small parts share writev() calls.     */
+#define MAX_BOUNDARY 70  /* RFC 2046's limit on the length of a boundary.     */
+
+typedef struct {
+   off_t  offset,
+          length;
+  size_t  hdr_len;  /* Length of the part's header, within the text block.    */
+} Ten4_Part;
+
+/* part_header():                                                             *
+ * Formats the boundary & header lines that go before part {*part} of a file  *
+ * of {size} octets into {out} (which has {room} octets; it may be NULL if    *
+ * {room} is 0).  Returns the length the text needs, or would have needed.    */
+static int
+part_header(char *out, size_t room, int first, const char *boundary,
+            const char *type, const Ten4_Part *part, off_t size)
+{ return snprintf(out, room,
+                  "%s--%s\r\n%s%s%sContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                  (first ? "" : "\r\n"), boundary,
+                  (type ? "Content-Type: " : ""), (type ? type : ""),
+                  (type ? "\r\n" : ""), (long long) part->offset,
+                  (long long) (part->offset + part->length - 1),
+                  (long long) size);
+} /* end of part_header()                                                     */
+
+/* plan_parts():                                                              *
+ * Turns {cnt} {ranges} of file {fd} into parts, stored in a new array with   *
+ * {*n_parts} entries.  If {text} is not NULL, the parts' headers & then the  *
+ * closing boundary are generated into a new block there as well.  {*body} is *
+ * set to the length of the whole multipart body.  Returns the array (which,  *
+ * like {*text}, the caller must free()), or NULL with {errno} set.           */
+static Ten4_Part *
+plan_parts(int fd, const Ten4_Range *ranges, int cnt, const char *boundary,
+           const char *type, int *n_parts, char **text, off_t *body)
+{ Ten4_Part *part;
+    Ten4_Vc  known;             /* For the file's size.                       */
+     size_t  text_len = 0,
+             b_len;
+      off_t  start, end;
+        int  n = 0;
+  if (ranges == NULL || boundary == NULL) { errno = EFAULT;  return NULL; }
+  b_len = strlen(boundary);
+  if (cnt <= 0 || b_len == 0 || b_len > MAX_BOUNDARY)
+  { errno = EINVAL;  return NULL; }
+  if (check_file(fd, &known)) return NULL;  /* errno OK.                      */
+  if ((part = malloc(cnt * sizeof(Ten4_Part))) == NULL)
+  { errno = ENOMEM;  return NULL; }
+  for (int i = 0; i < cnt; i++)
+  { start = ranges[i].offset;  end = start + ranges[i].length;
+    if (start < 0 || ranges[i].length <= 0 || start >= known.size)
+    { free(part);  errno = EINVAL;  return NULL; }
+    if (end > known.size || end < start) end = known.size;  /* Cut short.     */
+    if (n > 0 && start >= part[n - 1].offset
+        && start <= part[n - 1].offset + part[n - 1].length)
+    { if (end > part[n - 1].offset + part[n - 1].length)  /* Merge.           */
+        part[n - 1].length = end - part[n - 1].offset;
+    }
+    else { part[n].offset = start;  part[n].length = end - start;  n++; }
+  }
+  *body = 0;
+  for (int i = 0; i < n; i++)
+  { part[i].hdr_len = (size_t) part_header(NULL, 0, i == 0, boundary, type,
+                                           &part[i], known.size);
+    text_len += part[i].hdr_len;
+    *body    += (off_t) part[i].hdr_len + part[i].length;
+  }
+  text_len += b_len + 8;  /* The closing "\r\n--" boundary "--\r\n".          */
+  *body    += b_len + 8;
+  if (text != NULL)
+  { char *at;
+    if ((*text = at = malloc(text_len + 1)) == NULL)  /* + 1 for the NUL.     */
+    { free(part);  errno = ENOMEM;  return NULL; }
+    for (int i = 0; i < n; i++)
+      at += part_header(at, part[i].hdr_len + 1, i == 0, boundary, type,
+                        &part[i], known.size);
+    snprintf(at, b_len + 9, "\r\n--%s--\r\n", boundary);
+  }
+  *n_parts = n;
+  return part;
+} /* end of plan_parts()                                                      */
+
+
+/* ten4_sendfile_ranges_len():                                                *
+ * Returns the length of the body that ten4_sendfile_ranges() would send for  *
+ * the same arguments, less any headers & trailers; or -1 with {errno} set as *
+ * ten4_sendfile_ranges() would set it.                                       */
+off_t
+ten4_sendfile_ranges_len(int fd, const Ten4_Range *ranges, int cnt,
+                         const char *boundary, const char *type)
+{ Ten4_Part *part;
+      off_t  body;
+        int  n;
+  pthread_once(&config_once, load_config);
+  if ((part = plan_parts(fd, ranges, cnt, boundary, type, &n, NULL, &body))
+      == NULL)
+    return -1;
+  free(part);
+  return body;
+} /* end of ten4_sendfile_ranges_len()                                        */
+
+
+int
+ten4_sendfile_ranges(     int  fd,        /* Descriptor for the file to send. */
+                          int  sd,        /* Descriptor for the socket.       */
+             const Ten4_Range *ranges,    /* The byte ranges to send.         */
+                          int  cnt,       /* How many there are.              */
+                   const char *boundary,  /* The multipart boundary string.   */
+                   const char *type,      /* The parts' Content-Type, or NULL.*/
+                      Sf_HdTr *hdtr,      /* As for sendfile().               */
+                        off_t *len        /* Out:  Total octets sent.         */
+                    )
+{ Ten4_Part *part;
+     Sf_Vec *vec;
+       char *text, *at;
+      off_t  body;
+     size_t  sent = 0;
+    ssize_t  result;
+        int  n, k = 0,
+             hdr_cnt  = 0,
+             trlr_cnt = 0,
+             saved;
+  /* Sanity-check the arguments.                                              */
+  pthread_once(&config_once, load_config);
+  if (len == NULL) { errno = EINVAL;  return -1; }
+  *len = 0;
+  if (hdtr && (hdtr->headers != NULL || hdtr->hdr_cnt != 0))
+  { if (check_iovv(hdtr->headers, hdtr->hdr_cnt) < 0) return -1;
+    hdr_cnt = hdtr->hdr_cnt;
+  }
+  if (hdtr && (hdtr->trailers != NULL || hdtr->trlr_cnt != 0))
+  { if (check_iovv(hdtr->trailers, hdtr->trlr_cnt) < 0) return -1;
+    trlr_cnt = hdtr->trlr_cnt;
+  }
+  if ((part = plan_parts(fd, ranges, cnt, boundary, type, &n, &text, &body))
+      == NULL)
+    return -1;  /* plan_parts() already set {errno} to suit.                  */
+  if ((vec = malloc((hdr_cnt + 2 * n + 1 + trlr_cnt) * sizeof(Sf_Vec)))
+      == NULL)
+  { free(text);  free(part);  errno = ENOMEM;  return -1; }
+
+  /* Lay the whole response out for sendfilev().                              */
+#define MEM_PIECE(base, size)                                                 \
+  (vec[k].sfv_fd  = SFV_FD_SELF,  vec[k].sfv_flag = 0,                        \
+   vec[k].sfv_off = (off_t) (size_t) (base),  vec[k++].sfv_len = (size))
+  for (int i = 0; i < hdr_cnt; i++)
+    MEM_PIECE(hdtr->headers[i].iov_base, hdtr->headers[i].iov_len);
+  at = text;
+  for (int i = 0; i < n; i++)
+  { MEM_PIECE(at, part[i].hdr_len);
+    at += part[i].hdr_len;
+    vec[k].sfv_fd  = fd;              vec[k].sfv_flag = 0;
+    vec[k].sfv_off = part[i].offset;
+    vec[k++].sfv_len = (size_t) part[i].length;
+  }
+  MEM_PIECE(at, strlen(at));  /* The closing boundary.                        */
+  for (int i = 0; i < trlr_cnt; i++)
+    MEM_PIECE(hdtr->trailers[i].iov_base, hdtr->trailers[i].iov_len);
+#undef MEM_PIECE
+
+  result = sendfilev(sd, vec, k, &sent);
+  saved = errno;  /* Keep sendfilev()'s errno across the clean-up.            */
+  free(vec);  free(text);  free(part);
+  errno = saved;
+  *len = (off_t) sent;
+  return (result < 0 ? -1 : 0);
+} /* end of ten4_sendfile_ranges()                                            */
@@ -14,6 +14,7 @@
 #include_next <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <stdint.h>
 
 /* Per sys/uio.h, a {struct iovec} consists of a {void *} to a memory region, *
  * called "iov_base", & a {size_t} for its size, named "iov_len".  A {size_t} *
@@ -38,3 +39,411 @@ struct sf_hdtr {
 typedef struct sf_hdtr Sf_HdTr;
 
 int sendfile(int, int, off_t, off_t *, Sf_HdTr *, int);
+
+/* Bits that this library accepts in the {flags} argument of sendfile().      */
+#define TEN4_SF_MMAP      0x0001  /* Send straight from a mapping of the      *
+                                   * file, a window at a time, rather than    *
+                                   * read()ing it into a buffer.  Falls back  *
+                                   * to reading if it can't be mapped.  Note  *
+                                   * that truncating the file during the      *
+                                   * transfer raises SIGBUS.                  */
+#define TEN4_SF_PIPELINE  0x0002  /* Read the file ahead, on a helper thread, *
+                                   * into one buffer while sending another,   *
+                                   * overlapping disk & network waits.  Best  *
+                                   * for large files not already cached.      */
+#define TEN4_SF_RDADVISE  0x0004  /* Have the kernel read ahead of the send,  *
+                                   * a window at a time, via F_RDADVISE.      */
+#define TEN4_SF_NOCACHE   0x0008  /* Keep transfers of TEN4_OPT_NOCACHE_MIN   *
+                                   * octets or more out of the buffer cache,  *
+                                   * via F_NOCACHE, so as not to evict other  *
+                                   * files' data.  Note that this affects all *
+                                   * users of the same open file meanwhile.   */
+#define TEN4_SF_NODISKIO  0x0010  /* Never wait on the disk:  send only file  *
+                                   * data already in memory, then fail with   *
+                                   * EBUSY (& {*len} saying how far it got)   *
+                                   * at the first that is not, having asked   *
+                                   * the kernel to read it in, so that a      *
+                                   * retry soon after should get further.     *
+                                   * Overrides TEN4_SF_PIPELINE.              */
+#define TEN4_SF_SNDBUF    0x0020  /* For transfers of TEN4_OPT_SNDBUF_MIN     *
+                                   * octets or more, enlarge the socket's     *
+                                   * send buffer (up to TEN4_OPT_SNDBUF_MAX), *
+                                   * & raise its SO_SNDLOWAT to a chunk, so   *
+                                   * that each wait ends with room for a      *
+                                   * useful amount.  Both are put back when   *
+                                   * the transfer ends.                       */
+#define TEN4_SF_ALL       0x003F  /* All of the above.                        */
+
+/* Resumable transfers.  ten4_sendfile_init() validates its arguments, & can  *
+ * fail, exactly as sendfile() does, then records them in the context.  Each  *
+ * ten4_sendfile_step() sends as much as it can, returning 0 once everything  *
+ * has gone or else -1 with {errno} set; EAGAIN means to call it again after  *
+ * the socket becomes writable, & EBUSY (from TEN4_SF_NODISKIO) to call it    *
+ * again a little later, or from a thread that may block.  After EAGAIN, a    *
+ * TCP socket may stay corked (with TCP_NOPUSH) until a later step or the     *
+ * finish; any other failure puts the caller's setting back before returning. *
+ * ten4_sendfile_finish() reports the total of octets sent & ends the         *
+ * transfer, whether it completed or not.  The header and trailer arrays      *
+ * must outlive the context, but are only read from, & may be of any length;  *
+ * those beyond IOV_MAX go out in slices.  A context is declared here only    *
+ * so that callers can allocate one (on the stack, say, or inside their own   *
+ * structures); its members are for the library alone to touch.  Its layout   *
+ * may change from one version of the library to the next, which bumps the    *
+ * library's compatibility version, so a program must be built against the    *
+ * header of the library it is to run with.                                   */
+typedef struct ten4_pipe Ten4_Pipe;  /* Private to the library.               */
+typedef struct ten4_loop Ten4_Loop;  /* Private to the library.               */
+typedef struct ten4_centry Ten4_CEntry;  /* Private to the library.           */
+
+typedef struct ten4_sendfile_ctx {
+      int  fd;           /* The file being sent.                              */
+      int  sd;           /* The socket it is being sent to.                   */
+    off_t  file_pos;     /* Offset of the next file octet to send.            */
+    off_t  file_left;    /* Count of file octets still to send.               */
+    off_t  sent;         /* Octets sent so far, of all kinds.                 */
+    IOVec *headers;      /* Header data not yet sent.                         */
+      int  hdr_cnt;      /* Length of that array (zero once all sent).        */
+   size_t  hdr_skip;     /* Octets of headers[0] already sent.                */
+    off_t  hdr_len;      /* Octets of it still to send.                       */
+    IOVec *trailers;     /* Trailer data not yet sent.                        */
+      int  trlr_cnt;     /* Length of that array (zero once all sent).        */
+   size_t  trlr_skip;    /* Octets of trailers[0] already sent.               */
+    off_t  trlr_len;     /* Octets of it still to send.                       */
+      int  nonblocking;  /* Whether {sd} is marked for nonblocking I/O.       */
+      int  flags;        /* The TEN4_SF_* bits in effect.                     */
+     char *map_base;     /* Start of the file's mapped window, if any.        */
+    off_t  map_off;      /* File offset at which that window starts.          */
+   size_t  map_len;      /* Length of that window.                            */
+     char *buf;          /* Buffer for file data, once there is one.          */
+   size_t  buf_sz;       /* Its capacity.                                     */
+    off_t  buf_pos;      /* File offset of the octets read into it, &         */
+   size_t  buf_len;      /*   how many of them there are (0 if none).         */
+   size_t  chunk;        /* File octets to move per read & send.              */
+    off_t  advised;      /* Offset up to which read-ahead has been requested. */
+      int  nocache;      /* Whether F_NOCACHE was set for the transfer.       */
+      int  corked;       /* 1 if TCP_NOPUSH was set here (& is to be cleared  *
+                          * again), -1 if not to be, or 0 if yet undecided.   */
+      int  sndbuf;       /* For TEN4_SF_SNDBUF, the SO_SNDBUF to put back, or *
+                          * 0 if it was left alone; &                         */
+      int  sndlowat;     /*   likewise the SO_SNDLOWAT, or -1.                */
+  struct ten4_pipe *pipe;  /* Read-ahead state, for TEN4_SF_PIPELINE.         */
+  struct ten4_centry *cached;  /* The file's contents, if from the cache.     */
+    off_t  resident_to;  /* For TEN4_SF_NODISKIO, the offset up to which the  *
+                          * file was last found to be in memory.              */
+  struct ten4_loop *loop;  /* The loop driving it, if sent asynchronously.    */
+  void (*done)(struct ten4_sendfile_ctx *, int, off_t, void *);
+     void *done_arg;     /* What to pass to {done}.                           */
+  void (*digest)(void *, const void *, size_t);  /* Shown each file octet     *
+                                                 * sent, if not NULL.         */
+     void *digest_arg;   /* What to pass to {digest}.                         */
+      int  paced;        /* Whether file data must wait for tokens.           */
+  int64_t  pace_rate;    /* Its own rate limit, in octets/second, or 0.       */
+  int64_t  pace_tokens;  /* Its own bucket's contents, &                      */
+  int64_t  pace_stamp;   /*   when that was last topped up (0 for never).     */
+  int64_t  pace_due;     /* When, in microseconds since 1970, a transfer held *
+                          * back by pacing may go on (0 if it is not).        */
+  struct ten4_sendfile_ctx *prev, *next;  /* Links in {loop}'s list.          */
+} Ten4_Ctx;
+
+int ten4_sendfile_init(Ten4_Ctx *, int, int, off_t, off_t, Sf_HdTr *, int);
+int ten4_sendfile_step(Ten4_Ctx *);
+int ten4_sendfile_finish(Ten4_Ctx *, off_t *);
+
+/* Digests computed on the way out, so that the file need not be read again   *
+ * for an ETag or an integrity check.  After ten4_sendfile_init(), & before   *
+ * the first step, ten4_sendfile_digest() has every file octet the transfer   *
+ * sends passed to {fn}, with {arg}, in order & just once, as each piece goes *
+ * - headers & trailers excepted.  Should the transfer end short, {fn} has    *
+ * seen exactly the first {*len} octets, less any headers.  {fn} may compute  *
+ * anything (an MD5, say, via CC_MD5_Update()), but must be quick, as it runs *
+ * on the sending thread between writes.  ten4_crc32() is a fast CRC-32, the  *
+ * same as zlib's crc32(), & ten4_crc32_digest() a callback that keeps one    *
+ * running in the {uint32_t} that {arg} points to, which should start at 0.   */
+typedef void (*Ten4_Digest)(void *, const void *, size_t);
+
+int      ten4_sendfile_digest(Ten4_Ctx *, Ten4_Digest, void *);
+uint32_t ten4_crc32(uint32_t, const void *, size_t);
+void     ten4_crc32_digest(void *, const void *, size_t);
+
+/* Prefetching, for a caller that knows what it will send next (such as the   *
+ * files named by a page it has just served):  ten4_sendfile_prefetch()       *
+ * queues {len} octets of file {fd} from {offset} (or all the rest, if {len}  *
+ * is 0) to be brought into memory by a helper thread, & returns at once, so  *
+ * that a sendfile() of it soon after finds it there.  A file the content     *
+ * cache can take is read into it whole; anything else is read ahead by the   *
+ * kernel, via F_RDADVISE.  A request already covered by one still queued or  *
+ * under way is dropped.  {fd} must stay open until the request is done, or   *
+ * until it is sent.  Returns 0, or -1 with {errno} = EBADF, EINVAL (for a    *
+ * negative {offset} or {len}) or EAGAIN (if 64 requests are already queued). */
+int      ten4_sendfile_prefetch(int, off_t, off_t);
+
+/* Pacing, to keep bulk transfers from starving other traffic:                *
+ * TEN4_OPT_PACE_RATE limits all transfers together, & ten4_sendfile_pace()   *
+ * limits that of one context (after ten4_sendfile_init()), in octets per     *
+ * second; where both apply, the stricter wins at any moment.  Each is a      *
+ * token bucket holding TEN4_OPT_PACE_BURST octets, so a transfer may run at  *
+ * full speed for that long before being held to the rate, & one no bigger    *
+ * than that is never paced at all.  Only file data is paced.  A blocking     *
+ * transfer waits for its tokens; a nonblocking one fails with EAGAIN as if   *
+ * its socket were full, & an asynchronous one is woken by a kqueue timer (or *
+ * poll() timeout) once they are due; callers driving a nonblocking context   *
+ * themselves should step it again after a short wait.  Returns 0, or -1      *
+ * with {errno} = EFAULT or EINVAL (for a negative rate).                     */
+int      ten4_sendfile_pace(Ten4_Ctx *, int64_t);
+
+/* Asynchronous transfers, for event-driven callers.  ten4_sendfile_async()   *
+ * hands an initialised context, whose socket must be marked for nonblocking  *
+ * I/O, to a loop; it sends what it can at once, then more each time the      *
+ * socket becomes writable, until the transfer completes or fails.  Then the  *
+ * loop calls ten4_sendfile_finish() on it & calls back {done}, passing the   *
+ * context, 0 or an {errno} value, the total octets sent, & {arg}.  That can  *
+ * happen before ten4_sendfile_async() returns.  The context must stay put    *
+ * until called back, but may then be freed or reused at once.                *
+ *                                                                            *
+ * A loop is run by calling ten4_loop_run(), which waits up to {timeout_ms}   *
+ * milliseconds (forever, if negative) for sockets to become writable, moves  *
+ * their transfers along, & returns how many completed (or -1 & {errno}).     *
+ * It returns 0 at once if no transfers are pending.  Each loop belongs to a  *
+ * single thread.  ten4_loop_fd() returns a descriptor (its kqueue) that      *
+ * polls as readable whenever ten4_loop_run() has work to do, so the loop can *
+ * be nested under another event loop; or -1, if there is none to give.       *
+ * ten4_loop_destroy() calls back any transfers still pending, with the error *
+ * ECANCELED.                                                                 */
+typedef void (*Ten4_Done)(Ten4_Ctx *, int, off_t, void *);
+
+Ten4_Loop *ten4_loop_create(void);      /* NULL & {errno} on failure.         */
+int        ten4_loop_run(Ten4_Loop *, int);
+int        ten4_loop_fd(Ten4_Loop *);
+int        ten4_loop_pending(Ten4_Loop *);  /* Transfers not yet called back. */
+void       ten4_loop_destroy(Ten4_Loop *);
+int        ten4_sendfile_async(Ten4_Ctx *, Ten4_Loop *, Ten4_Done, void *);
+
+/* A pool of worker threads, each running a loop as above, to which whole     *
+ * transfers can be handed off.  ten4_pool_submit() queues an initialised     *
+ * context, whose socket must be nonblocking, for whichever worker gets to it *
+ * first:  a worker takes the newest context from its own queue, & when that  *
+ * is empty, the oldest from another's, so that one stuck reading a cold file *
+ * holds up no transfers but those it has already started.  Each transfer is  *
+ * given TEN4_SF_RDADVISE, so that the kernel reads ahead for it.  {done} is  *
+ * called back as for ten4_sendfile_async(), but on the worker's thread.      *
+ * {threads} is the number of workers; if 0 or less, there is one per         *
+ * processor.  ten4_pool_destroy() stops the workers, calling back any        *
+ * transfers still queued or pending with the error ECANCELED.                */
+typedef struct ten4_pool Ten4_Pool;  /* Private to the library.               */
+
+Ten4_Pool *ten4_pool_create(int);       /* NULL & {errno} on failure.         */
+int        ten4_pool_submit(Ten4_Pool *, Ten4_Ctx *, Ten4_Done, void *);
+void       ten4_pool_destroy(Ten4_Pool *);
+
+/* Batch sending, after the function of the same name in Solaris:  Each       *
+ * {struct sendfilevec} names either {sfv_len} octets of file {sfv_fd} from   *
+ * offset {sfv_off}, or (with {sfv_fd} set to SFV_FD_SELF) {sfv_len} octets   *
+ * of memory at address {sfv_off}.  They all go to the socket in order, with  *
+ * neighbouring small pieces sharing a writev().  Returns the total number of *
+ * octets sent, also stored in {*xferred}; or -1, with {errno} set as for     *
+ * sendfile() & {*xferred} saying how far it got.                             */
+#define SFV_FD_SELF (-2)
+
+struct sendfilevec {
+           int  sfv_fd;    /* A file descriptor, or SFV_FD_SELF.              */
+  unsigned int  sfv_flag;  /* Reserved.  Must be 0.                           */
+         off_t  sfv_off;   /* Where in the file, or the memory, to start.     */
+        size_t  sfv_len;   /* How many octets to send.                        */
+};
+typedef struct sendfilevec Sf_Vec;
+
+ssize_t sendfilev(int, const Sf_Vec *, int, size_t *);
+
+/* Multiple byte ranges of one file, as a "multipart/byteranges" HTTP body:   *
+ * ten4_sendfile_ranges() sends each range of {fd} as a part of its own, led  *
+ * by a generated boundary line & Content-Type & Content-Range headers, then  *
+ * the closing boundary; the Sf_HdTr headers go before it all, & trailers     *
+ * after, as with sendfile().  Ranges that touch or overlap the one before    *
+ * them in the list become a single part.  A range running past end-of-file   *
+ * is cut short; one starting there, or of length 0, is an EINVAL.  {type}    *
+ * may be NULL, to leave out the Content-Type headers.  Returns 0, or -1, &   *
+ * sets {*len}, exactly as sendfile() does.  ten4_sendfile_ranges_len() says  *
+ * how long the body (without the headers & trailers) will be, for use in a   *
+ * Content-Length header, or returns -1 with {errno} set.                     */
+typedef struct ten4_range {
+  off_t  offset;  /* Index of the first file octet in the range.              */
+  off_t  length;  /* Number of octets in it.                                  */
+} Ten4_Range;
+
+int   ten4_sendfile_ranges(int, int, const Ten4_Range *, int, const char *,
+                           const char *, Sf_HdTr *, off_t *);
+off_t ten4_sendfile_ranges_len(int, const Ten4_Range *, int, const char *,
+                               const char *);
+
+/* Process-wide tunables, for use with ten4_sendfile_setopt() and with        *
+ * ten4_sendfile_getopt().  Every value is an {int64_t}.  They are not locked *
+ * against concurrent change, so are best set before any sending starts.      */
+enum {
+  TEN4_OPT_TIMEOUT   = 1,  /* Milliseconds sendfile() may spend waiting for   *
+                            * {s} to drain, all stalls in one call combined.  *
+                            * If negative, there is no limit.  Default:  833. */
+  TEN4_OPT_COALESCE  = 2,  /* When headers, file data, and trailers together  *
+                            * come to no more than this many octets, they are *
+                            * sent with a single writev().  Default:  16384.  */
+  TEN4_OPT_CHUNK     = 3,  /* File octets to read & send at a time.  If zero, *
+                            * this is worked out per transfer from the file's *
+                            * block size & the socket's SO_SNDBUF.  Can also  *
+                            * be set via the environment variable named       *
+                            * TEN4SENDFILE_CHUNK.  Default:  0.               */
+  TEN4_OPT_CHUNK_MAX = 4,  /* The most that a chunk may be, regardless.       *
+                            * Default:  262144.                               */
+  TEN4_OPT_FLAGS     = 5,  /* TEN4_SF_* bits to apply to every transfer, on   *
+                            * top of those passed in.  Default:  0.           */
+  TEN4_OPT_ADVISE_WINDOW = 6,  /* Octets to request per F_RDADVISE, for       *
+                                * TEN4_SF_RDADVISE.  Default:  1048576.       */
+  TEN4_OPT_NOCACHE_MIN   = 7,  /* The smallest transfer that TEN4_SF_NOCACHE  *
+                                * applies to.  Default:  67108864.            */
+  TEN4_OPT_NATIVE    = 8,  /* If nonzero, sendfile() calls that use none of   *
+                            * this library's extensions are handed to the     *
+                            * kernel's own sendfile(), on Mac OS releases     *
+                            * (10.5 onward) that have one - unless the        *
+                            * content cache holds the file, in which case it  *
+                            * is sent from there.  Default:  1.               */
+  TEN4_OPT_VCACHE    = 9,  /* If nonzero, what was learnt validating each     *
+                            * file & socket descriptor is remembered, & later *
+                            * calls using it skip the fstat() & getsockopt(). *
+                            * Callers MUST then call ten4_sendfile_forget()   *
+                            * on closing a descriptor (or changing its file). *
+                            * Setting this to zero forgets everything.        *
+                            * Default:  0.                                    */
+  TEN4_OPT_CACHE_MAX = 10, /* Octets of memory that the content cache, which  *
+                            * keeps whole files' contents so as to send them  *
+                            * again without reading, may use in all.  If 0,   *
+                            * there is no caching.  A file is known by its    *
+                            * device, inode, size & modification time, so a   *
+                            * file changed twice within one second at the     *
+                            * same size can be sent stale.  Default:  0.      */
+  TEN4_OPT_CACHE_FILE_MAX = 11, /* The largest file that the content cache    *
+                                 * will take.  Default:  1048576.             */
+  TEN4_OPT_GATHER_MIN = 12,  /* When a response small enough to coalesce      *
+                              * has at least this many header & trailer       *
+                              * pieces in all, they are copied together       *
+                              * with the file data & sent as one, rather      *
+                              * than each being handed to writev() on its     *
+                              * own; this also lifts the limit of 64 pieces   *
+                              * on coalescing.  `ten4bench -g` shows where    *
+                              * copying starts to win.  If 0, they never      *
+                              * are.  Default:  0.                            */
+  TEN4_OPT_SNDBUF_MIN = 13,  /* The smallest transfer that TEN4_SF_SNDBUF     *
+                              * applies to.  Default:  1048576.               */
+  TEN4_OPT_SNDBUF_MAX = 14,  /* The largest send buffer TEN4_SF_SNDBUF asks   *
+                              * for; less is taken if the kernel refuses it   *
+                              * (Mac OS's kern.ipc.maxsockbuf).  Default:     *
+                              * 262144.                                       */
+  TEN4_OPT_PACE_RATE  = 15,  /* Octets per second that all transfers together *
+                              * may send, once each is past its burst (see    *
+                              * ten4_sendfile_pace()).  While this is nonzero *
+                              * the kernel's sendfile() is not used.  If 0,   *
+                              * there is no limit.  Default:  0.              */
+  TEN4_OPT_PACE_BURST = 16   /* Octets a paced transfer may send before the   *
+                              * rate applies, & the size of a token bucket.   *
+                              * Default:  65536.                              */
+};
+
+int ten4_sendfile_forget(int);  /* Drop the cache entry for a descriptor, or  *
+                                 * all of them if it is negative.  Returns 0. */
+
+int ten4_sendfile_setopt(int, int64_t);    /* 0 on success, else -1 & errno.  */
+int ten4_sendfile_getopt(int, int64_t *);  /* 0 on success, else -1 & errno.  */
+
+/* Process-wide statistics, as reported by ten4_sendfile_stats().  The counts *
+ * are kept per thread & summed on request, so a snapshot taken while others  *
+ * are sending may be a call or two out of date.  They run from the last      *
+ * ten4_sendfile_stats_reset(), or from process start.  Every member is a     *
+ * {uint64_t}, so that new ones can only ever be added at the end.            */
+#define TEN4_LAT_BUCKETS 24
+
+typedef struct ten4_stats {
+  uint64_t  calls_native;    /* sendfile() calls handed to the kernel's own.  */
+  uint64_t  calls_emulated;  /* sendfile() calls done by this library.        */
+  uint64_t  bytes_native;    /* Octets sent by the kernel's sendfile().       */
+  uint64_t  bytes_writev;    /* Octets sent by writev():  headers, trailers,  *
+                              * small responses sent whole, & the pieces that *
+                              * sendfilev() gathers together.                 */
+  uint64_t  bytes_cached;    /* File octets sent from the content cache,      */
+  uint64_t  bytes_mapped;    /*   from an mmap() window,                      */
+  uint64_t  bytes_piped;     /*   via the read-ahead pipeline,                */
+  uint64_t  bytes_read;      /*   & after a plain read into the buffer.       */
+  uint64_t  sys_read;        /* pread() calls, including failed ones.         */
+  uint64_t  sys_send;        /* send() calls, likewise.                       */
+  uint64_t  sys_writev;      /* writev() calls, likewise.                     */
+  uint64_t  eagain;          /* send()s & writev()s that found the socket     *
+                              * full.                                         */
+  uint64_t  emsgsize;        /* send()s refused as too big, & retried smaller.*/
+  uint64_t  partial;         /* send()s & writev()s that took only some of    *
+                              * what they were given.                         */
+  uint64_t  stall_usecs;     /* Microseconds spent waiting on full sockets or *
+                              * for mbufs to come free.                       */
+  uint64_t  latency[TEN4_LAT_BUCKETS];  /* sendfile() & sendfilev() calls by  *
+                              * duration:  latency[i] counts those taking 2^i *
+                              * to 2^(i+1) - 1 microseconds.  The first also  *
+                              * counts any quicker calls, & the last slower.  */
+  uint64_t  sys_fstat;       /* fstat() calls, in validating descriptors.     */
+  uint64_t  sys_sockopt;     /* getsockopt() & setsockopt() calls.            */
+  uint64_t  sys_fcntl;       /* fcntl() calls (& posix_fadvise() ones, where  *
+                              * that stands in for F_RDADVISE).               */
+  uint64_t  prefetched;      /* ten4_sendfile_prefetch() requests carried out *
+                              * (by the helper thread), &                     */
+  uint64_t  prefetch_dups;   /*   those dropped as already queued.            */
+  uint64_t  pace_waits;      /* Times a paced transfer had to wait for tokens *
+                              * to send its next chunk, &                     */
+  uint64_t  pace_usecs;      /*   microseconds spent asleep for them.         */
+} Ten4_Stats;
+
+int ten4_sendfile_stats(Ten4_Stats *);    /* 0 on success, else -1 & errno.   */
+void ten4_sendfile_stats_reset(void);     /* Zero the counts, process-wide.   */
+
+/* Trace files.  With TEN4SENDFILE_TRACE set in the environment to the path   *
+ * of a file, that file is created (or emptied) at start-up & mapped shared,  *
+ * & each sendfile() call leaves one Ten4_TraceRec in it.  The file holds a   *
+ * Ten4_TraceHdr, then TEN4_TRACE_RINGS rings of TEN4_TRACE_SLOTS records     *
+ * each.  A thread has a ring to itself, so writes it without locking, &      *
+ * once the ring is full overwrites its own oldest records.  (Threads beyond  *
+ * the number of rings go untraced until others exit.)  The companion tool,   *
+ * ten4trace, decodes the file on a machine of the same byte order.           */
+#define TEN4_TRACE_MAGIC "T4TRACE1"
+#define TEN4_TRACE_RINGS 64
+#define TEN4_TRACE_SLOTS 1024
+
+enum {                     /* The phases of a call that are timed apart.      */
+  TEN4_PH_VALIDATE = 0,    /* Checking the arguments & descriptors.           */
+  TEN4_PH_HEADERS,         /* Sending the headers.                            */
+  TEN4_PH_BODY,            /* Sending the file (or, if the response went out  *
+                            * whole in one writev(), all of it).              */
+  TEN4_PH_TRAILERS,        /* Sending the trailers.                           */
+  TEN4_PHASES
+};
+
+typedef struct ten4_trace_hdr {
+      char  magic[8];      /* TEN4_TRACE_MAGIC, without its NUL.              */
+  uint32_t  rec_size;      /* sizeof(Ten4_TraceRec).                          */
+  uint32_t  rings;         /* TEN4_TRACE_RINGS.                               */
+  uint32_t  slots;         /* TEN4_TRACE_SLOTS.                               */
+  uint32_t  pid;           /* The process that wrote it.                      */
+} Ten4_TraceHdr;
+
+typedef struct ten4_trace_rec {
+  uint64_t  seq;           /* 1 for a ring's first call, 2 for its next, &c.; *
+                            * 0 if the slot was never used.  Written last.    */
+  uint64_t  when;          /* Start of the call, in usec since the epoch.     */
+   int64_t  offset;        /* The arguments:  {offset},                       */
+   int64_t  asked;         /*   {*len} on the way in,                         */
+   int32_t  fd,            /*   {fd}                                          */
+            sd;            /*   & {sd}.                                       */
+   int64_t  sent;          /* {*len} on the way out.                          */
+   int32_t  error;         /* {errno} if the call failed, else 0.             */
+  uint32_t  native;        /* 1 if the kernel's sendfile() did it.            */
+  uint32_t  sys_read,      /* pread(),                                        */
+            sys_send,      /*   send()                                        */
+            sys_writev;    /*   & writev() calls made.                        */
+  uint32_t  retries;       /* Times the socket was found full, or a send()    *
+                            * was refused as too big.                         */
+  uint32_t  usecs[TEN4_PHASES];  /* Wall time spent in each phase, & ...      */
+  uint32_t  usecs_total;   /* ... in the call as a whole.                     */
+  uint32_t  spare;         /* Always 0; pads the record out to 96 octets.     */
+} Ten4_TraceRec;
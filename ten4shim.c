@@ -0,0 +1,307 @@
+/* ten4shim:  Counts, & can tamper with, the system calls that ten4sendfile   *
+ * makes, for the syscall budget check of ten4bench (its -b).                 *
+ *                                                                            *
+ * Build it as a shared library & load it into the benchmark ahead of all     *
+ * else:  on Mac OS, with DYLD_INSERT_LIBRARIES, & DYLD_FORCE_FLAT_NAMESPACE  *
+ * set, since it replaces the calls by name; elsewhere, with LD_PRELOAD.      *
+ * `make budget` does all that.  Each call covered is passed on to the real   *
+ * one, found with dlsym(RTLD_NEXT), & is only counted on threads that have   *
+ * asked for it to be, which leaves out the benchmark's receiving threads &   *
+ * its own housekeeping.  A program finds the controls with dlsym():          *
+ *                                                                            *
+ *   ten4shim_watch(on)        Starts (or, if {on} is 0, stops) counting &    *
+ *                             tampering with the calling thread's calls.     *
+ *   ten4shim_tamper(most, n)  Cuts each watched write(), writev() & send()   *
+ *                             down to at most {most} octets (or 0 for no     *
+ *                             limit), & fails every {n}th of them (or 0 for  *
+ *                             none) with EAGAIN, if its descriptor is marked *
+ *                             for nonblocking I/O.                           *
+ *   ten4shim_count(name)      Returns how many watched calls of {name}, such *
+ *                             as "writev", there have been, or 0 if it is    *
+ *                             not one of the calls covered.                  */
+
+#define _GNU_SOURCE 1  /* For RTLD_NEXT, under glibc.                         */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* As in ten4sendfile.c:                                                      */
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define TEN4_HAVE_KQUEUE 1
+#endif
+
+/* mincore()'s prototype is not the same everywhere.                          */
+#if defined(__APPLE__)
+typedef caddr_t        Mc_Addr;
+typedef char           Mc_Vec;
+#elif defined(__linux__)
+typedef void          *Mc_Addr;
+typedef unsigned char  Mc_Vec;
+#else
+typedef const void    *Mc_Addr;
+typedef char           Mc_Vec;
+#endif
+
+/* The calls covered, in the order of {names}.                                */
+enum { C_READ = 0, C_PREAD, C_LSEEK, C_WRITE, C_WRITEV, C_SEND, C_FSTAT,
+       C_FCNTL, C_GETSOCKOPT, C_SETSOCKOPT, C_MMAP, C_MUNMAP, C_MINCORE,
+       C_FADVISE, C_POLL, C_KQUEUE, C_KEVENT, C_NANOSLEEP, C_USLEEP, C_CALLS };
+
+static const char *names[C_CALLS] = {
+  "read", "pread", "lseek", "write", "writev", "send", "fstat", "fcntl",
+  "getsockopt", "setsockopt", "mmap", "munmap", "mincore", "posix_fadvise",
+  "poll", "kqueue", "kevent", "nanosleep", "usleep"
+};
+
+static pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        counts[C_CALLS],
+                       writes;            /* Watched writes, for {tamper_n}.  */
+static size_t          tamper_most = 0;
+static int             tamper_n    = 0;
+static pthread_key_t   watch_key;         /* Non-NULL on a watched thread.    */
+static pthread_once_t  watch_once = PTHREAD_ONCE_INIT;
+
+/* REAL():  Declares {real}, the next definition of call {name} after ours.   */
+#define REAL(type, name, args)                                                \
+  static type (*real) args = NULL;                                            \
+  if (real == NULL) real = (type (*) args) dlsym(RTLD_NEXT, #name)
+
+static void
+watch_init(void)
+{ pthread_key_create(&watch_key, NULL); }
+
+/* watched():                                                                 *
+ * Returns whether the calling thread's calls are being counted.              */
+static int
+watched(void)
+{ pthread_once(&watch_once, watch_init);
+  return (pthread_getspecific(watch_key) != NULL);
+} /* end of watched()                                                         */
+
+/* counted():                                                                 *
+ * Counts a call of {call}, if the calling thread is watched, & says whether  *
+ * it is.                                                                     */
+static int
+counted(int call)
+{ if (! watched()) return 0;
+  pthread_mutex_lock(&counts_lock);
+  counts[call]++;
+  pthread_mutex_unlock(&counts_lock);
+  return 1;
+} /* end of counted()                                                         */
+
+/* tampered():                                                                *
+ * For a watched write of {*len} octets to {fd}, counted as {call}:  cuts     *
+ * {*len} down as ten4shim_tamper() asked, & returns 1 if the write is to     *
+ * fail with EAGAIN instead, else 0.                                          */
+static int
+tampered(int call, int fd, size_t *len)
+{ REAL(int, fcntl, (int, int, ...));
+  uint64_t nth;
+  if (! counted(call)) return 0;
+  if (tamper_most > 0 && *len > tamper_most) *len = tamper_most;
+  pthread_mutex_lock(&counts_lock);
+  nth = ++writes;
+  pthread_mutex_unlock(&counts_lock);
+  return (tamper_n > 0 && nth % (uint64_t) tamper_n == 0
+          && (real(fd, F_GETFL) & O_NONBLOCK));
+} /* end of tampered()                                                        */
+
+
+void
+ten4shim_watch(int on)
+{ pthread_once(&watch_once, watch_init);
+  pthread_setspecific(watch_key, (on ? &watch_key : NULL));
+} /* end of ten4shim_watch()                                                  */
+
+void
+ten4shim_tamper(size_t most, int n)
+{ tamper_most = most;  tamper_n = (n > 0 ? n : 0); }
+
+uint64_t
+ten4shim_count(const char *name)
+{ uint64_t n = 0;
+  for (int i = 0; i < C_CALLS; i++)
+    if (strcmp(name, names[i]) == 0)
+    { pthread_mutex_lock(&counts_lock);
+      n = counts[i];
+      pthread_mutex_unlock(&counts_lock);
+    }
+  return n;
+} /* end of ten4shim_count()                                                  */
+
+
+/* The calls covered.                                                         */
+ssize_t
+read(int fd, void *buf, size_t len)
+{ REAL(ssize_t, read, (int, void *, size_t));
+  counted(C_READ);
+  return real(fd, buf, len);
+}
+
+ssize_t
+pread(int fd, void *buf, size_t len, off_t offset)
+{ REAL(ssize_t, pread, (int, void *, size_t, off_t));
+  counted(C_PREAD);
+  return real(fd, buf, len, offset);
+}
+
+off_t
+lseek(int fd, off_t offset, int whence)
+{ REAL(off_t, lseek, (int, off_t, int));
+  counted(C_LSEEK);
+  return real(fd, offset, whence);
+}
+
+ssize_t
+write(int fd, const void *buf, size_t len)
+{ REAL(ssize_t, write, (int, const void *, size_t));
+  if (tampered(C_WRITE, fd, &len)) { errno = EAGAIN;  return -1; }
+  return real(fd, buf, len);
+}
+
+ssize_t
+writev(int fd, const struct iovec *iov, int cnt)
+{ REAL(ssize_t, writev, (int, const struct iovec *, int));
+  struct iovec cut[IOV_MAX];
+        size_t most = SIZE_MAX,
+               left;
+           int n = 0;
+  if (tampered(C_WRITEV, fd, &most)) { errno = EAGAIN;  return -1; }
+  if (most == SIZE_MAX || cnt <= 0 || cnt > IOV_MAX)
+    return real(fd, iov, cnt);
+  /* Send only the first {most} octets, by way of a shortened copy.           */
+  for (left = most; n < cnt && left > 0; n++)
+  { cut[n] = iov[n];
+    if (cut[n].iov_len > left) cut[n].iov_len = left;
+    left -= cut[n].iov_len;
+  }
+  return real(fd, cut, n);
+}
+
+ssize_t
+send(int sd, const void *buf, size_t len, int flags)
+{ REAL(ssize_t, send, (int, const void *, size_t, int));
+  if (tampered(C_SEND, sd, &len)) { errno = EAGAIN;  return -1; }
+  return real(sd, buf, len, flags);
+}
+
+int
+fstat(int fd, struct stat *stats)
+{ REAL(int, fstat, (int, struct stat *));
+  counted(C_FSTAT);
+  return real(fd, stats);
+}
+
+int
+fcntl(int fd, int cmd, ...)
+{ REAL(int, fcntl, (int, int, ...));
+  va_list  ap;
+     void *arg;  /* Whatever the command takes, be it an {int} or a pointer.  */
+  va_start(ap, cmd);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+  counted(C_FCNTL);
+  return real(fd, cmd, arg);
+}
+
+int
+getsockopt(int sd, int level, int name, void *value, socklen_t *len)
+{ REAL(int, getsockopt, (int, int, int, void *, socklen_t *));
+  counted(C_GETSOCKOPT);
+  return real(sd, level, name, value, len);
+}
+
+int
+setsockopt(int sd, int level, int name, const void *value, socklen_t len)
+{ REAL(int, setsockopt, (int, int, int, const void *, socklen_t));
+  counted(C_SETSOCKOPT);
+  return real(sd, level, name, value, len);
+}
+
+void *
+mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
+{ REAL(void *, mmap, (void *, size_t, int, int, int, off_t));
+  counted(C_MMAP);
+  return real(addr, len, prot, flags, fd, offset);
+}
+
+int
+munmap(void *addr, size_t len)
+{ REAL(int, munmap, (void *, size_t));
+  counted(C_MUNMAP);
+  return real(addr, len);
+}
+
+int
+mincore(Mc_Addr addr, size_t len, Mc_Vec *vec)
+{ REAL(int, mincore, (Mc_Addr, size_t, Mc_Vec *));
+  counted(C_MINCORE);
+  return real(addr, len, vec);
+}
+
+#ifdef POSIX_FADV_WILLNEED
+int
+posix_fadvise(int fd, off_t offset, off_t len, int advice)
+{ REAL(int, posix_fadvise, (int, off_t, off_t, int));
+  counted(C_FADVISE);
+  return real(fd, offset, len, advice);
+}
+#endif
+
+int
+poll(struct pollfd *fds, nfds_t n, int timeout)
+{ REAL(int, poll, (struct pollfd *, nfds_t, int));
+  counted(C_POLL);
+  return real(fds, n, timeout);
+}
+
+#ifdef TEN4_HAVE_KQUEUE
+int
+kqueue(void)
+{ REAL(int, kqueue, (void));
+  counted(C_KQUEUE);
+  return real();
+}
+
+int
+kevent(int kq, const struct kevent *changes, int n_changes,
+       struct kevent *events, int n_events, const struct timespec *timeout)
+{ REAL(int, kevent, (int, const struct kevent *, int, struct kevent *, int,
+                     const struct timespec *));
+  counted(C_KEVENT);
+  return real(kq, changes, n_changes, events, n_events, timeout);
+}
+#endif
+
+/* usleep() is covered as well as nanosleep(), since on Mac OS it calls the   *
+ * latter from within libSystem, where no shim can see it.                    */
+int
+nanosleep(const struct timespec *want, struct timespec *left)
+{ REAL(int, nanosleep, (const struct timespec *, struct timespec *));
+  counted(C_NANOSLEEP);
+  return real(want, left);
+}
+
+int
+usleep(useconds_t usecs)
+{ REAL(int, usleep, (useconds_t));
+  counted(C_USLEEP);
+  return real(usecs);
+}
@@ -0,0 +1,115 @@
+/* ten4trace:  Decodes the trace file that ten4sendfile writes when the       *
+ * TEN4SENDFILE_TRACE environment variable names one.                         *
+ *                                                                            *
+ * Usage:  ten4trace [-m usecs] file                                          *
+ *                                                                            *
+ * Prints one line per sendfile() call recorded in {file}, oldest first,      *
+ * giving its arguments, what it sent, how it ended, the system calls it made *
+ * & where its time went.  With -m, only calls that took at least {usecs}     *
+ * microseconds are shown.  The file may be read while its process is still   *
+ * writing it; a record caught half-written is skipped, or shown garbled.     */
+
+#define TEN4SENDFILE 1
+#include "ten4sendfile.h"
+
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct stat Stat;
+
+/* by_when():                                                                 *
+ * Orders records for qsort(), by starting time & then by ring sequence.      */
+static int
+by_when(const void *a, const void *b)
+{ const Ten4_TraceRec *x = *(Ten4_TraceRec * const *) a,
+                      *y = *(Ten4_TraceRec * const *) b;
+  if (x->when != y->when) return (x->when < y->when ? -1 : 1);
+  return (x->seq < y->seq ? -1 : x->seq > y->seq);
+} /* end of by_when()                                                         */
+
+
+int
+main(int argc, char *argv[])
+{       Ten4_TraceHdr *hdr;
+        Ten4_TraceRec *recs,
+                     **order;
+                 Stat  stats;
+                 char *map,
+                      *end;
+                 long  min_usecs = 0;
+               size_t  size,
+                       total,
+                       n = 0;
+                  int  fd,
+                       opt;
+  while ((opt = getopt(argc, argv, "m:")) != -1)
+  { if (opt != 'm'
+        || (min_usecs = strtol(optarg, &end, 10)) < 0 || *end != '\0')
+    { fprintf(stderr, "usage:  %s [-m usecs] file\n", argv[0]);  return 2; }
+  }
+  if (optind != argc - 1)
+  { fprintf(stderr, "usage:  %s [-m usecs] file\n", argv[0]);  return 2; }
+
+  /* Map the file, & make sure it is one of ours in a layout we understand.   */
+  if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &stats))
+  { perror(argv[optind]);  return 1; }
+  size = (size_t) stats.st_size;
+  if (size < sizeof(Ten4_TraceHdr)
+      || (map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+  { fprintf(stderr, "%s:  not a trace file\n", argv[optind]);  return 1; }
+  hdr = (Ten4_TraceHdr *) map;
+  if (memcmp(hdr->magic, TEN4_TRACE_MAGIC, sizeof(hdr->magic))
+      || hdr->rec_size != sizeof(Ten4_TraceRec))
+  { fprintf(stderr, "%s:  not a trace file, or from another kind of machine\n",
+            argv[optind]);
+    return 1;
+  }
+  total = (size_t) hdr->rings * hdr->slots;
+  if (size < sizeof(Ten4_TraceHdr) + total * sizeof(Ten4_TraceRec))
+  { fprintf(stderr, "%s:  truncated\n", argv[optind]);  return 1; }
+  recs = (Ten4_TraceRec *) (map + sizeof(Ten4_TraceHdr));
+
+  /* Gather the slots in use, & put them in order.                            */
+  if ((order = malloc((total > 0 ? total : 1) * sizeof(*order))) == NULL)
+  { perror(argv[0]);  return 1; }
+  for (size_t i = 0; i < total; i++)
+    if (recs[i].seq != 0 && recs[i].usecs_total >= (uint32_t) min_usecs)
+      order[n++] = &recs[i];
+  qsort(order, n, sizeof(*order), by_when);
+
+  printf("# pid %lu, %lu of %lu slots shown\n", (unsigned long) hdr->pid,
+         (unsigned long) n, (unsigned long) total);
+  printf("# %-15s %4s %6s %4s %4s %12s %12s %12s %-7s %4s %4s %4s %4s"
+         " %9s %9s %9s %9s %9s\n", "when", "ring", "seq", "fd", "sd", "offset",
+         "asked", "sent", "result", "read", "send", "wrtv", "rtry",
+         "validate", "headers", "body", "trailers", "total");
+  for (size_t i = 0; i < n; i++)
+  { const Ten4_TraceRec *r = order[i];
+                   char  result[16];
+    if (r->error == 0)
+      strcpy(result, (r->native ? "native" : "ok"));
+    else
+      snprintf(result, sizeof(result), "err %ld", (long) r->error);
+    printf("%10lu.%06lu %4lu %6llu %4ld %4ld %12lld %12lld %12lld %-7s"
+           " %4lu %4lu %4lu %4lu %9lu %9lu %9lu %9lu %9lu\n",
+           (unsigned long) (r->when / 1000000),
+           (unsigned long) (r->when % 1000000),
+           (unsigned long) ((size_t) (r - recs) / hdr->slots),
+           (unsigned long long) r->seq, (long) r->fd, (long) r->sd,
+           (long long) r->offset, (long long) r->asked, (long long) r->sent,
+           result, (unsigned long) r->sys_read, (unsigned long) r->sys_send,
+           (unsigned long) r->sys_writev, (unsigned long) r->retries,
+           (unsigned long) r->usecs[TEN4_PH_VALIDATE],
+           (unsigned long) r->usecs[TEN4_PH_HEADERS],
+           (unsigned long) r->usecs[TEN4_PH_BODY],
+           (unsigned long) r->usecs[TEN4_PH_TRAILERS],
+           (unsigned long) r->usecs_total);
+  }
+  return 0;
+} /* end of main()                                                            */